@@ -30,11 +30,14 @@ threaddesc *dummythread, *tailthread;
 
 int numthreads;
 
+// set by sut_shutdown, which then waits on alldone for the last task to exit
+bool shuttingdown;
+
 ucontext_t *i_exec_context, *c_exec_context;
 
 struct queue readyQ, waitQ;
 pthread_t c_exec_id, i_exec_id;
-sem_t mutex, readyQmutex, waitQmutex;
+sem_t mutex, readyQmutex, waitQmutex, alldone;
 
 void *c_exec()
 {
@@ -117,6 +120,7 @@ void sut_init()
 {
     // initialize variables
     numthreads = 0;
+    shuttingdown = false;
     cur_c_thread = NULL;
     cur_i_thread = NULL;
     tailthread = NULL;
@@ -140,6 +144,7 @@ void sut_init()
     sem_init(&mutex, 0, 1);
     sem_init(&readyQmutex, 0, 1);
     sem_init(&waitQmutex, 0, 1);
+    sem_init(&alldone, 0, 0);
 
     // create two kernel threads: one for handling compute tasks and one for handling I/O tasks
     pthread_create(&i_exec_id, NULL, i_exec, NULL);
@@ -201,7 +206,7 @@ bool sut_create(sut_task_f fn)
     queue_insert_tail(&readyQ, node);
     sem_post(&readyQmutex);
 
-	return EXIT_SUCCESS;
+	return true;
 }
 
 void sut_yield()
@@ -223,13 +228,19 @@ void sut_exit()
     // cut cur_c_thread out of the circular linked list
     cur_c_thread->prev->next = cur_c_thread->next;
     cur_c_thread->next->prev = cur_c_thread->prev;
+    if (tailthread == cur_c_thread) {
+        tailthread = cur_c_thread->prev != dummythread ? cur_c_thread->prev : NULL;
+    }
 
     // get next context and swap without saving current context
     free(cur_c_thread);
     cur_c_thread = NULL;
 
-    // update number of user threads
+    // update number of user threads, waking sut_shutdown after the last one
     numthreads -= 1;
+    if (shuttingdown && numthreads == 0) {
+        sem_post(&alldone);
+    }
 
     sem_post(&mutex);
 
@@ -355,9 +366,47 @@ char *sut_read(int fd, char *buf, int size)
     return buf;
 }
 
+void *sut_io(sut_io_f fn, void *arg)
+{
+    // swap context and put task in wait queue
+    struct queue_entry *wnode = queue_new_node(cur_c_thread);
+
+    sem_wait(&waitQmutex);
+    queue_insert_tail(&waitQ, wnode);
+    sem_post(&waitQmutex);
+
+    swapcontext(cur_c_thread->threadcontext, c_exec_context);
+
+    // run the caller's blocking operation on the i_exec thread
+    void *result = fn(arg);
+
+    // swap context back to i_exec and place current thread in ready Q
+    struct queue_entry *rnode = queue_new_node(cur_i_thread);
+
+    sem_wait(&readyQmutex);
+    queue_insert_tail(&readyQ, rnode);
+    sem_post(&readyQmutex);
+
+    swapcontext(cur_i_thread->threadcontext, i_exec_context);
+
+    // return the result once c_exec picks this task up again
+    return result;
+}
+
 void sut_shutdown()
 {
     // wait for all tasks to terminate in both c_exec and i_exec
+    bool waiting;
+
+    sem_wait(&mutex);
+    shuttingdown = true;
+    waiting = numthreads > 0;
+    sem_post(&mutex);
+
+    if (waiting) {
+        sem_wait(&alldone);
+    }
+
     pthread_cancel(i_exec_id);
     pthread_cancel(c_exec_id);
 
@@ -365,9 +414,8 @@ void sut_shutdown()
     pthread_join(i_exec_id, NULL);
     pthread_join(c_exec_id, NULL);
 
-    // free heap memory
+    // free heap memory, every task has already freed its own descriptor
     free(dummythread);
-    free(tailthread);
     free(i_exec_context);
     free(c_exec_context);
 
@@ -375,4 +423,5 @@ void sut_shutdown()
     sem_destroy(&mutex);
     sem_destroy(&readyQmutex);
     sem_destroy(&waitQmutex);
+    sem_destroy(&alldone);
 }
@@ -7,6 +7,7 @@
 #define THREAD_STACK_SIZE           1024*1024
 
 typedef void (*sut_task_f)();
+typedef void *(*sut_io_f)(void *arg);
 
 void sut_init();
 bool sut_create(sut_task_f fn);
@@ -16,6 +17,7 @@ int sut_open(char *fname);
 void sut_write(int fd, char *buf, int size);
 void sut_close(int fd);
 char *sut_read(int fd, char *buf, int size);
+void *sut_io(sut_io_f fn, void *arg);
 void sut_shutdown();
 
 
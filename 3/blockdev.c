@@ -0,0 +1,569 @@
+/** @file blockdev.c
+ *  @brief Block devices SFS can be mounted on
+ *
+ *  The emu device forwards to the disk emulator. The pread and mmap
+ *  devices use the image file directly: it is created sparse, flush
+ *  makes it durable and discard punches holes into it, as the disk
+ *  emulator does for emu. The ram device
+ *  keeps its blocks in anonymous memory that survives close, so the
+ *  same process can unmount and attach it again, and only reads or
+ *  writes an image file when loaded or saved. None of them has
+ *  requests in flight after submit returns.
+ *
+ *  @bug No known bugs.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blockdev.h"
+#include "disk_emu.h"
+
+/** @brief Helper function for checking a request
+ *
+ *  @return 0 if the blocks are on the device and -1 otherwise
+*/
+int blockdev_check(blockdev_t* dev, int start_address, int nblocks) {
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > dev->num_blocks) {
+        printf("%s: out of bound error %d\n", dev->name, start_address);
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Helper function for the byte offset of a block
+ *
+ *  @return offset of the block in the image
+*/
+off_t block_offset(blockdev_t* dev, int block) {
+    return (off_t) block * dev->block_size;
+}
+
+/** @brief Submit for devices without asynchronous I/O
+ *
+ *  Runs every request to completion, in order.
+ *
+ *  @return the number of requests submitted
+*/
+int sync_submit(blockdev_t* dev, blockdev_request_t* reqs, int nreqs) {
+    for (int i=0; i<nreqs; i++) {
+        blockdev_request_t* r = &reqs[i];
+        if (r->op == BLOCKDEV_READ) r->result = dev->read(dev, r->start_address, r->nblocks, r->buffer);
+        else r->result = dev->write(dev, r->start_address, r->nblocks, r->buffer);
+        r->done = 1;
+    }
+    return nreqs;
+}
+
+/** @brief Poll for devices without asynchronous I/O
+ *
+ *  @return 0, nothing is ever in flight
+*/
+int sync_poll(blockdev_t* dev) {
+    return 0;
+}
+
+/** @brief Readv built on the device's read
+ *
+ *  @return the number of blocks read or -1
+*/
+int readv_by_read(blockdev_t* dev, int start_address, const struct iovec* iov, int iovcnt) {
+    int block = start_address;
+
+    for (int i=0; i<iovcnt; i++) {
+        int nblocks = iov[i].iov_len / dev->block_size;
+        if (dev->read(dev, block, nblocks, iov[i].iov_base) < 0) return -1;
+        block += nblocks;
+    }
+    return block - start_address;
+}
+
+/** @brief Helper function for zeroing blocks through the device's write
+ *
+ *  Used to discard blocks on images that can not punch holes.
+ *
+ *  @return the number of blocks zeroed or -1
+*/
+int discard_by_write(blockdev_t* dev, int start_address, int nblocks) {
+    char* zeros = (char*) calloc(nblocks, dev->block_size);
+    if (zeros == NULL) return -1;
+
+    int res = dev->write(dev, start_address, nblocks, zeros);
+    free(zeros);
+    return res;
+}
+
+/*
+ *  emu: the disk emulator. Its options (set_disk_latency(),
+ *  set_disk_write_queue(), ...) apply as before, since open
+ *  simply calls init_fresh_disk() or init_disk().
+*/
+
+int emu_open(blockdev_t* dev, char* filename, int block_size, int num_blocks, int fresh) {
+    dev->block_size = block_size;
+    dev->num_blocks = num_blocks;
+    if (fresh) return init_fresh_disk(filename, block_size, num_blocks);
+    return init_disk(filename, block_size, num_blocks);
+}
+
+int emu_close(blockdev_t* dev) {
+    return close_disk();
+}
+
+int emu_read(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    return read_blocks(start_address, nblocks, buffer);
+}
+
+int emu_write(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    return write_blocks(start_address, nblocks, buffer);
+}
+
+int emu_flush(blockdev_t* dev) {
+    return flush_disk();
+}
+
+int emu_discard(blockdev_t* dev, int start_address, int nblocks) {
+    return discard_blocks(start_address, nblocks);
+}
+
+blockdev_t blockdev_emu = {
+    .name = "emu",
+    .open = emu_open,
+    .close = emu_close,
+    .read = emu_read,
+    .write = emu_write,
+    .readv = readv_by_read,
+    .flush = emu_flush,
+    .discard = emu_discard,
+    .submit = sync_submit,
+    .poll = sync_poll,
+    .fd = -1,
+};
+
+/** @brief Helper function for opening an image file
+ *
+ *  A fresh image is created sparse at its full size, an existing
+ *  one must be at least that large.
+ *
+ *  @return 0 on success and -1 on failure
+*/
+int open_image(blockdev_t* dev, char* filename, int block_size, int num_blocks, int fresh) {
+    struct stat st;
+    off_t size = (off_t) block_size * num_blocks;
+
+    dev->block_size = block_size;
+    dev->num_blocks = num_blocks;
+    dev->fd = open(filename, fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (dev->fd == -1) {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+
+    if (fresh ? ftruncate(dev->fd, size) == -1 : fstat(dev->fd, &st) == -1 || st.st_size < size) {
+        printf("Could not size %s to %ld bytes\n", filename, (long) size);
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Helper function for punching a hole into the image
+ *
+ *  @return 0 on success and -1 if the file system can not do it
+*/
+int punch_hole(blockdev_t* dev, int start_address, int nblocks) {
+    return fallocate(
+        dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        block_offset(dev, start_address), (off_t) nblocks * dev->block_size
+    );
+}
+
+/*
+ *  pread: plain positional I/O on the image file, with the host
+ *  page cache in front of it and no simulated latency.
+*/
+
+int pread_close(blockdev_t* dev) {
+    if (dev->fd != -1) close(dev->fd);
+    dev->fd = -1;
+    return 0;
+}
+
+/** @brief Helper function for a whole transfer
+ *
+ *  pread and pwrite may transfer fewer bytes than asked for,
+ *  so we keep going until the whole range is done.
+ *
+ *  @return the number of blocks transferred or -1
+*/
+int pread_transfer(blockdev_t* dev, int is_write, int start_address, int nblocks, char* buffer) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+
+    size_t len = (size_t) nblocks * dev->block_size;
+    off_t off = block_offset(dev, start_address);
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = is_write ?
+            pwrite(dev->fd, buffer + done, len - done, off + done) :
+            pread(dev->fd, buffer + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return nblocks;
+}
+
+int pread_read(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    return pread_transfer(dev, 0, start_address, nblocks, (char*) buffer);
+}
+
+int pread_write(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    return pread_transfer(dev, 1, start_address, nblocks, (char*) buffer);
+}
+
+/** @brief Readv with a single preadv call
+ *
+ *  Falls back to one read per buffer if the call comes up short.
+ *
+ *  @return the number of blocks read or -1
+*/
+int pread_readv(blockdev_t* dev, int start_address, const struct iovec* iov, int iovcnt) {
+    size_t len = 0;
+    for (int i=0; i<iovcnt; i++) len += iov[i].iov_len;
+
+    int nblocks = len / dev->block_size;
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+
+    if (preadv(dev->fd, iov, iovcnt, block_offset(dev, start_address)) == (ssize_t) len) return nblocks;
+    return readv_by_read(dev, start_address, iov, iovcnt);
+}
+
+int pread_flush(blockdev_t* dev) {
+    return fdatasync(dev->fd);
+}
+
+int pread_discard(blockdev_t* dev, int start_address, int nblocks) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+    if (punch_hole(dev, start_address, nblocks) == 0) return nblocks;
+    return discard_by_write(dev, start_address, nblocks);
+}
+
+blockdev_t blockdev_pread = {
+    .name = "pread",
+    .open = open_image,
+    .close = pread_close,
+    .read = pread_read,
+    .write = pread_write,
+    .readv = pread_readv,
+    .flush = pread_flush,
+    .discard = pread_discard,
+    .submit = sync_submit,
+    .poll = sync_poll,
+    .fd = -1,
+};
+
+/*
+ *  mmap: the image file mapped shared, so every transfer is a
+ *  memcpy and the kernel writes the pages back.
+*/
+
+int mmap_open(blockdev_t* dev, char* filename, int block_size, int num_blocks, int fresh) {
+    if (open_image(dev, filename, block_size, num_blocks, fresh) == -1) return -1;
+
+    dev->mem_size = (size_t) block_size * num_blocks;
+    dev->mem = (char*) mmap(NULL, dev->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->mem == MAP_FAILED) {
+        printf("Could not map %s\n", filename);
+        dev->mem = NULL;
+        pread_close(dev);
+        return -1;
+    }
+    return 0;
+}
+
+int mmap_close(blockdev_t* dev) {
+    if (dev->mem != NULL) munmap(dev->mem, dev->mem_size);
+    dev->mem = NULL;
+    return pread_close(dev);
+}
+
+/** @brief Read for the devices that hold the disk in memory
+ *
+ *  @return the number of blocks read or -1
+*/
+int mem_read(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+    memcpy(buffer, dev->mem + block_offset(dev, start_address), (size_t) nblocks * dev->block_size);
+    return nblocks;
+}
+
+/** @brief Write for the devices that hold the disk in memory
+ *
+ *  @return the number of blocks written or -1
+*/
+int mem_write(blockdev_t* dev, int start_address, int nblocks, void* buffer) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+    memcpy(dev->mem + block_offset(dev, start_address), buffer, (size_t) nblocks * dev->block_size);
+    return nblocks;
+}
+
+int mmap_flush(blockdev_t* dev) {
+    return msync(dev->mem, dev->mem_size, MS_SYNC);
+}
+
+int mmap_discard(blockdev_t* dev, int start_address, int nblocks) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+    if (punch_hole(dev, start_address, nblocks) == 0) return nblocks;
+
+    memset(dev->mem + block_offset(dev, start_address), 0, (size_t) nblocks * dev->block_size);
+    return nblocks;
+}
+
+blockdev_t blockdev_mmap = {
+    .name = "mmap",
+    .open = mmap_open,
+    .close = mmap_close,
+    .read = mem_read,
+    .write = mem_write,
+    .readv = readv_by_read,
+    .flush = mmap_flush,
+    .discard = mmap_discard,
+    .submit = sync_submit,
+    .poll = sync_poll,
+    .fd = -1,
+};
+
+/*
+ *  ram: the disk lives in anonymous memory and never touches a file 
+ *  unless asked to. The memory is kept when the device is closed, so 
+ *  a later mksfs(0) in the same process finds the file system again; 
+ *  attaching a RAM disk that does not exist yet loads the image file. 
+ *  ram_hugepages asks for huge pages, see blockdev_ram_hugepages().
+*/
+int ram_hugepages = 0;
+
+/** @brief Back the RAM disk with huge pages
+ *
+ *  Takes effect the next time a RAM disk is created. Explicit huge
+ *  pages (MAP_HUGETLB) are used when the host has some reserved,
+ *  transparent huge pages are requested otherwise.
+ *
+ *  @param enable 1 to use huge pages
+ *  @return void
+*/
+void blockdev_ram_hugepages(int enable) {
+    ram_hugepages = enable;
+}
+
+/** @brief Helper function for releasing the RAM disk
+ *
+ *  @return void
+*/
+void ram_free(blockdev_t* dev) {
+    if (dev->mem != NULL) munmap(dev->mem, dev->mem_size);
+    dev->mem = NULL;
+    dev->mem_size = 0;
+}
+
+/** @brief Helper function for creating an empty RAM disk
+ *
+ *  The mapping is zero-filled by the kernel on first touch, so an 
+ *  empty disk costs nothing until it is written.
+ *
+ *  @return 0 on success and -1 on failure
+*/
+int ram_alloc(blockdev_t* dev, int block_size, int num_blocks) {
+    size_t size = (size_t) block_size * num_blocks;
+    size_t huge = 2 * 1024 * 1024;
+
+    ram_free(dev);
+    dev->block_size = block_size;
+    dev->num_blocks = num_blocks;
+
+    if (ram_hugepages) {
+        dev->mem_size = (size + huge - 1) / huge * huge;
+        dev->mem = (char*) mmap(NULL, dev->mem_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (dev->mem != MAP_FAILED) return 0;
+    } else {
+        dev->mem_size = size;
+    }
+
+    dev->mem = (char*) mmap(NULL, dev->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dev->mem == MAP_FAILED) {
+        printf("Could not allocate a RAM disk of %d blocks\n", num_blocks);
+        dev->mem = NULL;
+        dev->mem_size = 0;
+        return -1;
+    }
+    if (ram_hugepages) madvise(dev->mem, dev->mem_size, MADV_HUGEPAGE);
+    return 0;
+}
+
+/** @brief Load an image file into a RAM disk
+ *
+ *  Replaces the RAM disk with a new one holding the contents of the 
+ *  image, sized by the image. Must not be called while the disk is 
+ *  mounted; mksfs(0) attaches the loaded file system.
+ *
+ *  @param dev the RAM disk
+ *  @param filename the image to load
+ *  @param block_size block size of the image
+ *  @return 0 on success and -1 on failure
+*/
+int blockdev_ram_load(blockdev_t* dev, char* filename, int block_size) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        printf("Could not open %s\n\n", filename);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    if (ram_alloc(dev, block_size, st.st_size / block_size) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    size_t len = (size_t) dev->num_blocks * block_size;
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(fd, dev->mem + done, len - done, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("Could not read %s\n", filename);
+            close(fd);
+            ram_free(dev);
+            return -1;
+        }
+        done += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/** @brief Save a RAM disk to an image file
+ *
+ *  Writes a snapshot of the disk to a temporary file which then 
+ *  replaces the image, so a crash never leaves a half-written image. 
+ *  Blocks that are all zeros are left as holes. Flush the file 
+ *  system first (sfs_sync()) so that the snapshot is consistent.
+ *
+ *  @param dev the RAM disk
+ *  @param filename the image to write
+ *  @return 0 on success and -1 on failure
+*/
+int blockdev_ram_save(blockdev_t* dev, char* filename) {
+    char tmp[4096];
+    char zeros[dev->block_size];
+    int res = 0;
+
+    if (dev->mem == NULL) return -1;
+    memset(zeros, 0, sizeof(zeros));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, (off_t) dev->num_blocks * dev->block_size) == -1) {
+        printf("Could not create %s\n", tmp);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    for (int i=0; i<dev->num_blocks && res == 0; i++) {
+        char* block = dev->mem + block_offset(dev, i);
+        if (memcmp(block, zeros, dev->block_size) == 0) continue;
+        if (pwrite(fd, block, dev->block_size, block_offset(dev, i)) != dev->block_size) res = -1;
+    }
+    if (res == 0 && fsync(fd) == -1) res = -1;
+    close(fd);
+
+    if (res == 0 && rename(tmp, filename) == -1) res = -1;
+    if (res == -1) {
+        printf("Could not save the RAM disk to %s\n", filename);
+        unlink(tmp);
+    }
+    return res;
+}
+
+int ram_open(blockdev_t* dev, char* filename, int block_size, int num_blocks, int fresh) {
+    if (fresh) return ram_alloc(dev, block_size, num_blocks);
+
+    if (dev->mem == NULL && blockdev_ram_load(dev, filename, block_size) == -1) return -1;
+    if (dev->block_size != block_size || dev->num_blocks < num_blocks) {
+        printf("No RAM disk of %d blocks to attach\n", num_blocks);
+        return -1;
+    }
+    return 0;
+}
+
+int ram_close(blockdev_t* dev) {
+    return 0;
+}
+
+int ram_flush(blockdev_t* dev) {
+    return 0;
+}
+
+/** @brief Discard for the RAM disk
+ *
+ *  Whole pages inside the range are handed back to the kernel, 
+ *  which frees them and zero-fills them again on the next touch, 
+ *  so the disk only holds memory for the blocks in use. The rest 
+ *  of the range is zeroed.
+ *
+ *  @return the number of blocks discarded or -1
+*/
+int ram_discard(blockdev_t* dev, int start_address, int nblocks) {
+    if (blockdev_check(dev, start_address, nblocks) == -1) return -1;
+
+    long page = sysconf(_SC_PAGESIZE);
+    char* start = dev->mem + block_offset(dev, start_address);
+    char* end = start + (size_t) nblocks * dev->block_size;
+    char* first = dev->mem + (start - dev->mem + page - 1) / page * page;
+    char* last = dev->mem + (end - dev->mem) / page * page;
+
+    if (first >= last || madvise(first, last - first, MADV_DONTNEED) == -1) {
+        memset(start, 0, end - start);
+    } else {
+        memset(start, 0, first - start);
+        memset(last, 0, end - last);
+    }
+    return nblocks;
+}
+
+blockdev_t blockdev_ram = {
+    .name = "ram",
+    .open = ram_open,
+    .close = ram_close,
+    .read = mem_read,
+    .write = mem_write,
+    .readv = readv_by_read,
+    .flush = ram_flush,
+    .discard = ram_discard,
+    .submit = sync_submit,
+    .poll = sync_poll,
+    .fd = -1,
+};
+
+/** @brief Find a block device by name
+ *
+ *  @param name one of emu, pread, mmap or ram
+ *  @return the device or NULL if there is none by that name
+*/
+blockdev_t* blockdev_by_name(const char* name) {
+    blockdev_t* devs[] = {&blockdev_emu, &blockdev_pread, &blockdev_mmap, &blockdev_ram};
+
+    for (int i=0; i<(int) (sizeof(devs) / sizeof(devs[0])); i++) {
+        if (strcmp(devs[i]->name, name) == 0) return devs[i];
+    }
+    return NULL;
+}
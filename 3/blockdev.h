@@ -0,0 +1,83 @@
+/** @file blockdev.h
+ *  @brief Block devices SFS can be mounted on
+ *
+ *  A block device is a table of operations plus the state of one open
+ *  disk. SFS does all of its I/O through the device it was mounted on
+ *  (see sfs_set_blockdev()), so the backend can be picked per
+ *  deployment, or replaced by a test double, without touching SFS:
+ *
+ *    emu    the disk emulator, with its latency model, O_DIRECT, write
+ *           queue, cache tier, arrays and tracing (the default)
+ *    pread  plain pread/pwrite on a sparse image file
+ *    mmap   the image file mapped shared into memory
+ *    ram    an in-memory disk that lives as long as the process, with
+ *           explicit snapshots to and from an image file
+ *
+ *  @bug There is no io_uring backend: liburing is not available on the
+ *  hosts we build on. submit/poll are there for one, and every backend
+ *  above completes its requests inside submit.
+ */
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define BLOCKDEV_READ 0
+#define BLOCKDEV_WRITE 1
+
+/** @struct one request handed to submit
+ * op: BLOCKDEV_READ or BLOCKDEV_WRITE
+ * result: number of blocks transferred or -1, valid once done is set
+*/
+typedef struct {
+    int op;
+    int start_address;
+    int nblocks;
+    void* buffer;
+    int result;
+    int done;
+} blockdev_request_t;
+
+typedef struct blockdev blockdev_t;
+
+/** @struct a block device
+ * open: formats (fresh) or attaches the disk of num_blocks blocks
+ * readv: reads consecutive blocks into the buffers of iov, each a
+ *     multiple of the block size
+ * flush: everything written so far is durable once it returns
+ * discard: the blocks are no longer in use and may read back as zeros
+ * submit: starts the requests, poll reaps finished ones and returns
+ *     how many are still in flight
+*/
+struct blockdev {
+    const char* name;
+    int (*open)(blockdev_t* dev, char* filename, int block_size, int num_blocks, int fresh);
+    int (*close)(blockdev_t* dev);
+    int (*read)(blockdev_t* dev, int start_address, int nblocks, void* buffer);
+    int (*write)(blockdev_t* dev, int start_address, int nblocks, void* buffer);
+    int (*readv)(blockdev_t* dev, int start_address, const struct iovec* iov, int iovcnt);
+    int (*flush)(blockdev_t* dev);
+    int (*discard)(blockdev_t* dev, int start_address, int nblocks);
+    int (*submit)(blockdev_t* dev, blockdev_request_t* reqs, int nreqs);
+    int (*poll)(blockdev_t* dev);
+
+    int block_size;
+    int num_blocks;
+    int fd;
+    char* mem;
+    size_t mem_size;
+};
+
+extern blockdev_t blockdev_emu;
+extern blockdev_t blockdev_pread;
+extern blockdev_t blockdev_mmap;
+extern blockdev_t blockdev_ram;
+
+blockdev_t* blockdev_by_name(const char* name);
+void blockdev_ram_hugepages(int enable);
+int blockdev_ram_load(blockdev_t* dev, char* filename, int block_size);
+int blockdev_ram_save(blockdev_t* dev, char* filename);
+
+#endif
@@ -1,143 +1,1365 @@
-#include <stdio.h>
-#include <stdlib.h> 
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, s;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-    }
-
-    free(blockRead);
-    return s;
-}
-
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, s;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-    return s;
-}
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h> 
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "disk_emu.h"
+
+/*Alignment required for buffers, offsets and sizes when using O_DIRECT*/
+#define DIRECT_IO_ALIGN 4096
+
+/*Passed as is_write to member_io/array_io: a write that drops the blocks*/
+#define DISK_DISCARD 2
+
+/*Tiered cache: on-image format and destaging policy*/
+#define CACHE_MAGIC 0xCAC4E001
+#define CACHE_DESTAGE_INTERVAL_MS 50
+#define CACHE_DESTAGE_BATCH 32
+
+/*One image file backing the emulated disk*/
+typedef struct {
+    int fd;
+    int direct;         /*opened with O_DIRECT*/
+    int head;           /*block right after the last one touched, for the seek model*/
+    int num_blocks;     /*size of this image in blocks*/
+    double block_usec;  /*transfer cost per block*/
+    double seek_usec;   /*full-stroke seek cost*/
+    double busy;        /*time charged to this image by the current request*/
+    double free_at;     /*clock time at which this image is done with its requests*/
+} disk_member_t;
+
+/*Header stored in the first block of a cache image*/
+typedef struct {
+    unsigned int magic;
+    unsigned int block_size;
+    unsigned int slots;
+    unsigned int backing_blocks;
+} cache_header_t;
+
+/*Persistent map entry of one cache slot: the backing block it holds, or -1*/
+typedef struct {
+    int block;
+    int dirty;
+} cache_entry_t;
+
+double L, p;
+double r;
+double S;
+int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+
+/*Layout of the emulated disk over its image files*/
+static int disk_mode = DISK_SINGLE;
+static int chunk_blocks = 1;
+static int num_members = 0;
+static int next_mirror = 0;
+static char *member_names[MAX_DISK_IMAGES];
+static disk_member_t members[MAX_DISK_IMAGES];
+
+static disk_stats_t disk_stats;
+
+/*Serializes requests against the background destager and queue flusher*/
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Tiered cache state. The map is persisted right after the header, slots follow it*/
+static char *cache_name = NULL;
+static int cache_slots = 0;
+static int cache_map_blocks = 0;
+static disk_member_t cache_dev;
+static cache_entry_t *cache_map = NULL;
+static unsigned long *cache_used = NULL;
+static unsigned long cache_clock = 0;
+static int *cache_slot_of = NULL;
+static int cache_dirty_count = 0;
+static char *cache_scratch = NULL;
+static int destage_running = 0;
+static pthread_t destage_thread;
+static pthread_cond_t destage_cond = PTHREAD_COND_INITIALIZER;
+
+/*Pending-write queue: blocks waiting to be merged and written in address order*/
+static int queue_max = 0;
+static int queue_timeout_ms = 0;
+static int queue_len = 0;
+static int queue_head = 0;
+static int *queue_addr = NULL;
+static char *queue_data = NULL;
+static char *queue_run = NULL;
+static struct timespec queue_oldest;
+static int queue_running = 0;
+static pthread_t queue_thread;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/*Block I/O trace of every request, see disk_trace_record_t*/
+static char *trace_name = NULL;
+static FILE *trace_fp = NULL;
+static struct timespec trace_start;
+
+static void stop_disk_cache();
+static void stop_write_queue();
+
+/*O_DIRECT state: requested flag and the bounce buffer*/
+static int use_direct_io = 0;
+static void* direct_buffer = NULL;
+static int direct_buffer_blocks = 0;
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    int i;
+    stop_write_queue();
+    stop_disk_cache();
+    if (trace_fp != NULL)
+    {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    for (i = 0; i < num_members; i++)
+    {
+        if(-1 != members[i].fd)
+        {
+            close(members[i].fd);
+            members[i].fd = -1;
+        }
+    }
+    num_members = 0;
+    free(direct_buffer);
+    direct_buffer = NULL;
+    direct_buffer_blocks = 0;
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Asks for the next disk to be opened with O_DIRECT, bypassing the*/
+/*host page cache. Must be called before init_(fresh_)disk.        */
+/*----------------------------------------------------------------*/
+void set_disk_direct_io(int enable)
+{
+    use_direct_io = enable;
+}
+
+/*----------------------------------------------------------------*/
+/*Sets the latency model: block_usec is charged for every block    */
+/*transferred and seek_usec for a full-stroke seek, scaled by the  */
+/*distance between the head and the requested block.               */
+/*----------------------------------------------------------------*/
+void set_disk_latency(double block_usec, double seek_usec)
+{
+    int i;
+    L = block_usec;
+    S = seek_usec;
+    for (i = 0; i < num_members; i++)
+    {
+        members[i].block_usec = L;
+        members[i].seek_usec = S;
+    }
+}
+
+/*----------------------------------------------------------------*/
+/*Puts a small cache image with no injected latency in front of    */
+/*the disk, acting as a persistent write-back and read cache of    */
+/*nslots blocks. Passing NULL disables it. Must be called before   */
+/*init_(fresh_)disk.                                               */
+/*----------------------------------------------------------------*/
+void set_disk_cache(char *filename, int nslots)
+{
+    cache_name = nslots > 0 ? filename : NULL;
+    cache_slots = cache_name != NULL ? nslots : 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Holds up to max_blocks written blocks in memory so that adjacent */
+/*ones can be merged and written in address order. The queue is    */
+/*flushed when full, on flush_disk() and once its oldest block has */
+/*waited timeout_ms. Passing 0 disables it. Must be called before  */
+/*init_(fresh_)disk.                                               */
+/*----------------------------------------------------------------*/
+void set_disk_write_queue(int max_blocks, int timeout_ms)
+{
+    queue_max = max_blocks > 0 ? max_blocks : 0;
+    queue_timeout_ms = timeout_ms > 0 ? timeout_ms : 1;
+}
+
+/*----------------------------------------------------------------*/
+/*Logs every read_blocks/write_blocks request of the next disk to  */
+/*a binary trace file. Passing NULL disables it. Must be called    */
+/*before init_(fresh_)disk.                                        */
+/*----------------------------------------------------------------*/
+void set_disk_trace(char *filename)
+{
+    trace_name = filename;
+}
+
+/*----------------------------------------------------------------*/
+/*Creates the trace file and writes its header                     */
+/*----------------------------------------------------------------*/
+static int start_disk_trace()
+{
+    disk_trace_header_t header;
+
+    if ((trace_fp = fopen(trace_name, "wb")) == NULL)
+    {
+        printf("Could not create trace file %s\n\n", trace_name);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = DISK_TRACE_MAGIC;
+    header.block_size = BLOCK_SIZE;
+    header.num_blocks = MAX_BLOCK;
+    fwrite(&header, sizeof(header), 1, trace_fp);
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Appends one request to the trace                                 */
+/*----------------------------------------------------------------*/
+static void trace_request(int is_write, int start_address, int nblocks)
+{
+    struct timespec now;
+    disk_trace_record_t record;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&record, 0, sizeof(record));
+    record.usec = (now.tv_sec - trace_start.tv_sec) * 1000000ULL + (now.tv_nsec - trace_start.tv_nsec) / 1000;
+    record.address = start_address;
+    record.nblocks = nblocks;
+    record.op = is_write == DISK_DISCARD ? DISK_TRACE_DISCARD : is_write ? DISK_TRACE_WRITE : DISK_TRACE_READ;
+    fwrite(&record, sizeof(record), 1, trace_fp);
+}
+
+/*----------------------------------------------------------------*/
+/*Spans the next disk over several image files instead of the one  */
+/*passed to init_(fresh_)disk. DISK_STRIPED spreads chunks of      */
+/*chunk_size blocks round-robin over the images (RAID-0) and       */
+/*DISK_MIRRORED keeps a full copy on every image (RAID-1). Passing */
+/*no images goes back to the single image. Must be called before   */
+/*init_(fresh_)disk.                                               */
+/*----------------------------------------------------------------*/
+int set_disk_array(int mode, int chunk_size, int nimages, char **filenames)
+{
+    int i;
+
+    if (nimages == 0)
+    {
+        disk_mode = DISK_SINGLE;
+        chunk_blocks = 1;
+        return 0;
+    }
+    if ((mode != DISK_STRIPED && mode != DISK_MIRRORED) ||
+        nimages < 1 || nimages > MAX_DISK_IMAGES || chunk_size < 1)
+    {
+        printf("Invalid disk array of %d images\n", nimages);
+        return -1;
+    }
+
+    disk_mode = mode;
+    chunk_blocks = chunk_size;
+    num_members = 0;
+    for (i = 0; i < nimages; i++)
+    {
+        member_names[i] = filenames[i];
+    }
+    for (; i < MAX_DISK_IMAGES; i++)
+    {
+        member_names[i] = NULL;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Copies the I/O counters and simulated latency accumulated so far */
+/*----------------------------------------------------------------*/
+void get_disk_stats(disk_stats_t *out)
+{
+    *out = disk_stats;
+}
+
+/*----------------------------------------------------------------*/
+/*Opens the image file, with O_DIRECT if requested. Filesystems    */
+/*like tmpfs refuse O_DIRECT, in which case we fall back to normal */
+/*buffered I/O rather than failing the whole mount.                */
+/*----------------------------------------------------------------*/
+static int open_member(disk_member_t *m, char *filename, int flags)
+{
+    m->direct = 0;
+    m->head = 0;
+    m->busy = 0;
+    m->free_at = 0;
+    m->block_usec = L;
+    m->seek_usec = S;
+
+    if (use_direct_io)
+    {
+        if (BLOCK_SIZE % 512 != 0)
+        {
+            printf("Block size %d is not compatible with O_DIRECT, using buffered I/O\n", BLOCK_SIZE);
+        }
+        else
+        {
+            m->fd = open(filename, flags | O_DIRECT, 0644);
+            if (m->fd != -1)
+            {
+                m->direct = 1;
+                return m->fd;
+            }
+            printf("Could not open %s with O_DIRECT (%s), using buffered I/O\n", filename, strerror(errno));
+        }
+    }
+
+    m->fd = open(filename, flags, 0644);
+    return m->fd;
+}
+
+/*----------------------------------------------------------------*/
+/*Opens every image of the disk. A single image uses filename,     */
+/*an array uses the names given to set_disk_array.                 */
+/*----------------------------------------------------------------*/
+static int open_disk(char *filename, int flags)
+{
+    int i, n, chunks;
+
+    /*Re-initializing the emulator releases the disk opened before*/
+    close_disk();
+
+    if (disk_mode == DISK_SINGLE)
+    {
+        member_names[0] = filename;
+        n = 1;
+    }
+    else
+    {
+        for (n = 0; n < MAX_DISK_IMAGES && member_names[n] != NULL; n++);
+    }
+
+    /*Striped images only hold their share of the chunks*/
+    chunks = (MAX_BLOCK + chunk_blocks - 1) / chunk_blocks;
+    for (i = 0; i < n; i++)
+    {
+        if (open_member(&members[i], member_names[i], flags) == -1)
+        {
+            printf("Could not open %s\n\n", member_names[i]);
+            num_members = i;
+            close_disk();
+            return -1;
+        }
+        if (disk_mode == DISK_STRIPED)
+        {
+            members[i].num_blocks = ((chunks + n - 1) / n) * chunk_blocks;
+        }
+        else
+        {
+            members[i].num_blocks = MAX_BLOCK;
+        }
+    }
+    num_members = n;
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Returns a buffer that is safe to hand to the kernel for nblocks. */
+/*Aligned caller buffers are used as is, anything else goes        */
+/*through a reusable aligned bounce buffer.                        */
+/*----------------------------------------------------------------*/
+static void* io_buffer(disk_member_t *m, void *buffer, int nblocks)
+{
+    if (!m->direct || ((unsigned long) buffer) % DIRECT_IO_ALIGN == 0)
+    {
+        return buffer;
+    }
+
+    if (nblocks > direct_buffer_blocks)
+    {
+        free(direct_buffer);
+        direct_buffer = NULL;
+        direct_buffer_blocks = 0;
+
+        if (posix_memalign(&direct_buffer, DIRECT_IO_ALIGN, (size_t) nblocks * BLOCK_SIZE) != 0)
+        {
+            direct_buffer = NULL;
+            return NULL;
+        }
+        direct_buffer_blocks = nblocks;
+    }
+    return direct_buffer;
+}
+
+/*----------------------------------------------------------------*/
+/*Punches a hole over a run of blocks of one image, so that the    */
+/*host frees their space. Images on file systems without hole      */
+/*punching get zeros written instead. Costs no simulated time.     */
+/*----------------------------------------------------------------*/
+static int member_discard(disk_member_t *m, int address, int nblocks)
+{
+    int i;
+    char *zeros;
+    off_t offset = (off_t) address * BLOCK_SIZE;
+
+    if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t) nblocks * BLOCK_SIZE) == 0)
+    {
+        return nblocks;
+    }
+
+    if (posix_memalign((void **) &zeros, DIRECT_IO_ALIGN, BLOCK_SIZE) != 0)
+    {
+        return -1;
+    }
+    memset(zeros, 0, BLOCK_SIZE);
+    for (i = 0; i < nblocks; i++)
+    {
+        pwrite(m->fd, zeros, BLOCK_SIZE, offset + (off_t) i * BLOCK_SIZE);
+    }
+    free(zeros);
+    return nblocks;
+}
+
+/*----------------------------------------------------------------*/
+/*Transfers a contiguous run of blocks on one image and charges    */
+/*its transfer and seek time to that image.                        */
+/*----------------------------------------------------------------*/
+static int member_io(disk_member_t *m, int is_write, int address, int nblocks, char *buffer)
+{
+    ssize_t n;
+    size_t len = (size_t) nblocks * BLOCK_SIZE;
+    off_t offset = (off_t) address * BLOCK_SIZE;
+    char *io;
+    int distance = address > m->head ? address - m->head : m->head - address;
+
+    if (is_write == DISK_DISCARD)
+    {
+        return member_discard(m, address, nblocks);
+    }
+
+    io = io_buffer(m, buffer, nblocks);
+    if (io == NULL)
+    {
+        return -1;
+    }
+
+    m->busy += m->block_usec * nblocks + m->seek_usec * distance / m->num_blocks;
+    m->head = address + nblocks;
+
+    if (is_write)
+    {
+        if (io != buffer)
+        {
+            memcpy(io, buffer, len);
+        }
+        n = pwrite(m->fd, io, len, offset);
+    }
+    else
+    {
+        n = pread(m->fd, io, len, offset);
+        if (n > 0 && io != buffer)
+        {
+            memcpy(buffer, io, n);
+        }
+    }
+
+    return n < 0 ? -1 : n / BLOCK_SIZE;
+}
+
+/*----------------------------------------------------------------*/
+/*Current time in microseconds on the clock the images are         */
+/*scheduled against                                                */
+/*----------------------------------------------------------------*/
+static double disk_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/*----------------------------------------------------------------*/
+/*Sleeps until the given disk_clock() time, when a request is done */
+/*----------------------------------------------------------------*/
+static void wait_disk(double done)
+{
+    struct timespec until;
+
+    if (done <= disk_clock())
+    {
+        return;
+    }
+    until.tv_sec = (time_t) (done / 1e6);
+    until.tv_nsec = (long) ((done - until.tv_sec * 1e6) * 1e3);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+/*----------------------------------------------------------------*/
+/*Maps a request on the emulated disk onto its images. The images  */
+/*work in parallel, but each one serves its requests one at a time:*/
+/*an image starts on its part once it is done with the requests    */
+/*before, and no earlier than done, the time at which the previous */
+/*step of the same request finishes. done is moved to the time the */
+/*busiest image finishes.                                          */
+/*----------------------------------------------------------------*/
+static int array_io(int is_write, int start_address, int nblocks, char *buffer, double *done)
+{
+    int i, s, n, block, count;
+    double slowest = 0, start;
+    disk_member_t *m;
+    s = 0;
+
+    for (i = 0; i < num_members; i++)
+    {
+        members[i].busy = 0;
+    }
+
+    if (disk_mode == DISK_STRIPED)
+    {
+        for (block = start_address; block < start_address + nblocks; block += count)
+        {
+            int chunk = block / chunk_blocks;
+            count = chunk_blocks - block % chunk_blocks;
+            if (count > start_address + nblocks - block)
+            {
+                count = start_address + nblocks - block;
+            }
+
+            m = &members[chunk % num_members];
+            n = member_io(m, is_write, (chunk / num_members) * chunk_blocks + block % chunk_blocks,
+                          count, buffer == NULL ? NULL : buffer + (size_t) (block - start_address) * BLOCK_SIZE);
+            if (n < 0)
+            {
+                break;
+            }
+            s += n;
+        }
+    }
+    else if (disk_mode == DISK_MIRRORED && is_write)
+    {
+        /*Every replica gets the write, the request completes once all of them have it*/
+        s = nblocks;
+        for (i = 0; i < num_members; i++)
+        {
+            n = member_io(&members[i], is_write, start_address, nblocks, buffer);
+            if (n < s)
+            {
+                s = n;
+            }
+        }
+    }
+    else
+    {
+        /*Mirrored reads are balanced round-robin over the replicas*/
+        m = &members[0];
+        if (disk_mode == DISK_MIRRORED)
+        {
+            m = &members[next_mirror];
+            next_mirror = (next_mirror + 1) % num_members;
+        }
+        s = member_io(m, is_write, start_address, nblocks, buffer);
+    }
+
+    start = *done;
+    for (i = 0; i < num_members; i++)
+    {
+        if (members[i].busy == 0)
+        {
+            continue;
+        }
+        if (members[i].busy > slowest)
+        {
+            slowest = members[i].busy;
+        }
+        if (members[i].free_at < start)
+        {
+            members[i].free_at = start;
+        }
+        members[i].free_at += members[i].busy;
+        if (members[i].free_at > *done)
+        {
+            *done = members[i].free_at;
+        }
+    }
+
+    disk_stats.busy_usec += slowest;
+    return s;
+}
+
+/*----------------------------------------------------------------*/
+/*Persists the map block holding the entry of the given slot       */
+/*----------------------------------------------------------------*/
+static void cache_save_entry(int slot)
+{
+    int block = (slot * sizeof(cache_entry_t)) / BLOCK_SIZE;
+    member_io(&cache_dev, 1, 1 + block, 1, (char *) cache_map + (size_t) block * BLOCK_SIZE);
+}
+
+/*----------------------------------------------------------------*/
+/*Copies a dirty slot back to the slow disk and marks it clean     */
+/*----------------------------------------------------------------*/
+static void cache_destage(int slot, double *done)
+{
+    member_io(&cache_dev, 0, 1 + cache_map_blocks + slot, 1, cache_scratch);
+    array_io(1, cache_map[slot].block, 1, cache_scratch, done);
+
+    cache_map[slot].dirty = 0;
+    cache_dirty_count--;
+    cache_save_entry(slot);
+}
+
+/*----------------------------------------------------------------*/
+/*Returns the slot caching the given block. On a miss the least    */
+/*recently used slot is taken over, destaging it first if dirty.   */
+/**hit tells the caller whether the slot already holds the block.  */
+/*----------------------------------------------------------------*/
+static int cache_get_slot(int block, int *hit, double *done)
+{
+    int i, slot = cache_slot_of[block];
+
+    *hit = slot != -1;
+    if (!*hit)
+    {
+        for (i = 0; i < cache_slots; i++)
+        {
+            if (cache_map[i].block == -1)
+            {
+                slot = i;
+                break;
+            }
+            if (slot == -1 || cache_used[i] < cache_used[slot])
+            {
+                slot = i;
+            }
+        }
+
+        if (cache_map[slot].block != -1)
+        {
+            if (cache_map[slot].dirty)
+            {
+                cache_destage(slot, done);
+            }
+            cache_slot_of[cache_map[slot].block] = -1;
+
+            /*Forget the old block on the image before its data is overwritten*/
+            cache_map[slot].block = -1;
+            cache_save_entry(slot);
+        }
+
+        cache_map[slot].block = block;
+        cache_map[slot].dirty = 0;
+        cache_slot_of[block] = slot;
+    }
+
+    cache_used[slot] = ++cache_clock;
+    return slot;
+}
+
+/*----------------------------------------------------------------*/
+/*Serves a request through the cache image. Reads promote missing  */
+/*blocks into the cache, writes only land on the cache image and   */
+/*are destaged to the slow disk later.                             */
+/*----------------------------------------------------------------*/
+static int tier_io(int is_write, int start_address, int nblocks, char *buffer, double *done)
+{
+    int i, hit, slot;
+    char *block_buffer;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        block_buffer = buffer + (size_t) i * BLOCK_SIZE;
+        slot = cache_get_slot(start_address + i, &hit, done);
+
+        if (is_write)
+        {
+            member_io(&cache_dev, 1, 1 + cache_map_blocks + slot, 1, block_buffer);
+            if (!cache_map[slot].dirty)
+            {
+                cache_map[slot].dirty = 1;
+                cache_dirty_count++;
+                cache_save_entry(slot);
+            }
+        }
+        else if (hit)
+        {
+            member_io(&cache_dev, 0, 1 + cache_map_blocks + slot, 1, block_buffer);
+        }
+        else
+        {
+            array_io(0, start_address + i, 1, block_buffer, done);
+            member_io(&cache_dev, 1, 1 + cache_map_blocks + slot, 1, block_buffer);
+            cache_save_entry(slot);
+        }
+    }
+    return nblocks;
+}
+
+/*----------------------------------------------------------------*/
+/*Sorts dirty slots by the address of the block they hold          */
+/*----------------------------------------------------------------*/
+static int compare_slots(const void *a, const void *b)
+{
+    return cache_map[*(const int *) a].block - cache_map[*(const int *) b].block;
+}
+
+/*----------------------------------------------------------------*/
+/*Background destager: wakes up periodically and writes a batch of */
+/*dirty slots back to the slow disk in address order. It waits for */
+/*the writes without holding the lock so requests keep flowing,    */
+/*but they occupy the images like any other request.               */
+/*----------------------------------------------------------------*/
+static void *destage_loop(void *arg)
+{
+    int i, n;
+    int batch[CACHE_DESTAGE_BATCH];
+    double done;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&disk_lock);
+    while (destage_running)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CACHE_DESTAGE_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&destage_cond, &disk_lock, &deadline);
+
+        if (!destage_running || cache_dirty_count == 0)
+        {
+            continue;
+        }
+
+        for (i = 0, n = 0; i < cache_slots && n < CACHE_DESTAGE_BATCH; i++)
+        {
+            if (cache_map[i].block != -1 && cache_map[i].dirty)
+            {
+                batch[n++] = i;
+            }
+        }
+        qsort(batch, n, sizeof(int), compare_slots);
+
+        done = disk_clock();
+        for (i = 0; i < n; i++)
+        {
+            cache_destage(batch[i], &done);
+        }
+
+        pthread_mutex_unlock(&disk_lock);
+        wait_disk(done);
+        pthread_mutex_lock(&disk_lock);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return NULL;
+}
+
+/*----------------------------------------------------------------*/
+/*Opens the cache image. A fresh disk always gets an empty cache,  */
+/*an existing one reloads the persisted map if the cache image     */
+/*was made for a disk of the same geometry.                        */
+/*----------------------------------------------------------------*/
+static int start_disk_cache(int fresh)
+{
+    int i;
+    cache_header_t *header;
+
+    cache_map_blocks = (cache_slots * sizeof(cache_entry_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (open_member(&cache_dev, cache_name, O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0)) == -1)
+    {
+        printf("Could not open cache image %s\n\n", cache_name);
+        return -1;
+    }
+
+    /*The cache image is the fast tier: no injected latency*/
+    cache_dev.num_blocks = 1 + cache_map_blocks + cache_slots;
+    cache_dev.block_usec = 0;
+    cache_dev.seek_usec = 0;
+
+    if (posix_memalign((void **) &cache_map, DIRECT_IO_ALIGN, (size_t) cache_map_blocks * BLOCK_SIZE) != 0 ||
+        posix_memalign((void **) &cache_scratch, DIRECT_IO_ALIGN, BLOCK_SIZE) != 0)
+    {
+        return -1;
+    }
+    cache_used = (unsigned long *) calloc(cache_slots, sizeof(unsigned long));
+    cache_slot_of = (int *) malloc(MAX_BLOCK * sizeof(int));
+
+    for (i = 0; i < MAX_BLOCK; i++)
+    {
+        cache_slot_of[i] = -1;
+    }
+
+    /*Reload the persisted map when it belongs to this disk*/
+    memset(cache_scratch, 0, BLOCK_SIZE);
+    header = (cache_header_t *) cache_scratch;
+    if (!fresh &&
+        member_io(&cache_dev, 0, 0, 1, cache_scratch) == 1 &&
+        header->magic == CACHE_MAGIC &&
+        header->block_size == BLOCK_SIZE &&
+        header->slots == cache_slots &&
+        header->backing_blocks == MAX_BLOCK &&
+        member_io(&cache_dev, 0, 1, cache_map_blocks, (char *) cache_map) == cache_map_blocks)
+    {
+        cache_dirty_count = 0;
+        for (i = 0; i < cache_slots; i++)
+        {
+            if (cache_map[i].block < 0 || cache_map[i].block >= MAX_BLOCK)
+            {
+                cache_map[i].block = -1;
+                continue;
+            }
+            cache_slot_of[cache_map[i].block] = i;
+            cache_dirty_count += cache_map[i].dirty != 0;
+        }
+    }
+    else
+    {
+        memset(cache_scratch, 0, BLOCK_SIZE);
+        header->magic = CACHE_MAGIC;
+        header->block_size = BLOCK_SIZE;
+        header->slots = cache_slots;
+        header->backing_blocks = MAX_BLOCK;
+        member_io(&cache_dev, 1, 0, 1, cache_scratch);
+
+        memset(cache_map, 0, (size_t) cache_map_blocks * BLOCK_SIZE);
+        for (i = 0; i < cache_slots; i++)
+        {
+            cache_map[i].block = -1;
+        }
+        member_io(&cache_dev, 1, 1, cache_map_blocks, (char *) cache_map);
+        ftruncate(cache_dev.fd, (off_t) cache_dev.num_blocks * BLOCK_SIZE);
+        cache_dirty_count = 0;
+    }
+
+    destage_running = 1;
+    pthread_create(&destage_thread, NULL, destage_loop, NULL);
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Stops the destager and writes every dirty slot back so the slow  */
+/*disk is complete on its own. Clean slots stay cached on the      */
+/*cache image for the next mount.                                  */
+/*----------------------------------------------------------------*/
+static void stop_disk_cache()
+{
+    int i;
+    double done = disk_clock();
+
+    if (cache_map == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    destage_running = 0;
+    pthread_cond_signal(&destage_cond);
+    pthread_mutex_unlock(&disk_lock);
+    pthread_join(destage_thread, NULL);
+
+    for (i = 0; i < cache_slots; i++)
+    {
+        if (cache_map[i].block != -1 && cache_map[i].dirty)
+        {
+            cache_destage(i, &done);
+        }
+    }
+
+    close(cache_dev.fd);
+    free(cache_map);
+    free(cache_scratch);
+    free(cache_used);
+    free(cache_slot_of);
+    cache_map = NULL;
+    cache_scratch = NULL;
+    cache_used = NULL;
+    cache_slot_of = NULL;
+}
+
+/*----------------------------------------------------------------*/
+/*Sends a request below the write queue: through the cache tier    */
+/*when there is one, straight to the images otherwise.             */
+/*----------------------------------------------------------------*/
+static int lower_io(int is_write, int start_address, int nblocks, char *buffer, double *done)
+{
+    if (cache_map != NULL)
+    {
+        return tier_io(is_write, start_address, nblocks, buffer, done);
+    }
+    return array_io(is_write, start_address, nblocks, buffer, done);
+}
+
+/*----------------------------------------------------------------*/
+/*Sorts queued blocks by address                                   */
+/*----------------------------------------------------------------*/
+static int compare_queued(const void *a, const void *b)
+{
+    return queue_addr[*(const int *) a] - queue_addr[*(const int *) b];
+}
+
+/*----------------------------------------------------------------*/
+/*Writes the whole queue out like an elevator: sweeping up from    */
+/*where the last flush ended, then wrapping around to the lowest   */
+/*address. Runs of adjacent blocks go out as one write.            */
+/*----------------------------------------------------------------*/
+static void flush_write_queue(double *done)
+{
+    int i, k, start, n, first;
+    int order[queue_max];
+
+    if (queue_len == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < queue_len; i++)
+    {
+        order[i] = i;
+    }
+    qsort(order, queue_len, sizeof(int), compare_queued);
+
+    /*Start the sweep at the first block at or after the head*/
+    for (first = 0; first < queue_len && queue_addr[order[first]] < queue_head; first++);
+    if (first == queue_len)
+    {
+        first = 0;
+    }
+
+    for (k = 0; k < queue_len; k += n)
+    {
+        start = queue_addr[order[(first + k) % queue_len]];
+        for (n = 0; k + n < queue_len; n++)
+        {
+            i = order[(first + k + n) % queue_len];
+            if (queue_addr[i] != start + n)
+            {
+                break;
+            }
+            memcpy(queue_run + (size_t) n * BLOCK_SIZE, queue_data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+
+        lower_io(1, start, n, queue_run, done);
+        queue_head = start + n;
+    }
+
+    queue_len = 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Adds written blocks to the queue. A block that is already queued */
+/*is simply overwritten, so repeated metadata writes collapse.     */
+/*----------------------------------------------------------------*/
+static int queue_write(int start_address, int nblocks, char *buffer, double *done)
+{
+    int i, j;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        for (j = 0; j < queue_len && queue_addr[j] != start_address + i; j++);
+
+        if (j == queue_len)
+        {
+            if (queue_len == queue_max)
+            {
+                flush_write_queue(done);
+                j = 0;
+            }
+            if (queue_len == 0)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &queue_oldest);
+            }
+            queue_addr[j] = start_address + i;
+            queue_len++;
+        }
+        memcpy(queue_data + (size_t) j * BLOCK_SIZE, buffer + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return nblocks;
+}
+
+/*----------------------------------------------------------------*/
+/*Reads through the queue: queued blocks are newer than the disk,  */
+/*and the disk is skipped entirely when every block is queued.     */
+/*----------------------------------------------------------------*/
+static int queue_read(int start_address, int nblocks, char *buffer, double *done)
+{
+    int i, hits = 0, s = nblocks;
+
+    for (i = 0; i < queue_len; i++)
+    {
+        if (queue_addr[i] >= start_address && queue_addr[i] < start_address + nblocks)
+        {
+            hits++;
+        }
+    }
+
+    if (hits < nblocks)
+    {
+        s = lower_io(0, start_address, nblocks, buffer, done);
+    }
+
+    for (i = 0; i < queue_len && hits > 0; i++)
+    {
+        if (queue_addr[i] >= start_address && queue_addr[i] < start_address + nblocks)
+        {
+            memcpy(buffer + (size_t) (queue_addr[i] - start_address) * BLOCK_SIZE,
+                   queue_data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    return s;
+}
+
+/*----------------------------------------------------------------*/
+/*Returns whether the oldest queued block has waited long enough   */
+/*----------------------------------------------------------------*/
+static int queue_expired()
+{
+    struct timespec now;
+
+    if (queue_len == 0)
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - queue_oldest.tv_sec) * 1000L +
+           (now.tv_nsec - queue_oldest.tv_nsec) / 1000000L >= queue_timeout_ms;
+}
+
+/*----------------------------------------------------------------*/
+/*Flushes the queue once it expires, even if no request comes in   */
+/*----------------------------------------------------------------*/
+static void *queue_loop(void *arg)
+{
+    double done;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&disk_lock);
+    while (queue_running)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += queue_timeout_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&queue_cond, &disk_lock, &deadline);
+
+        if (!queue_running || !queue_expired())
+        {
+            continue;
+        }
+
+        done = disk_clock();
+        flush_write_queue(&done);
+
+        pthread_mutex_unlock(&disk_lock);
+        wait_disk(done);
+        pthread_mutex_lock(&disk_lock);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return NULL;
+}
+
+/*----------------------------------------------------------------*/
+/*Allocates the write queue and starts its timeout thread          */
+/*----------------------------------------------------------------*/
+static int start_write_queue()
+{
+    queue_len = 0;
+    queue_head = 0;
+    queue_addr = (int *) malloc(queue_max * sizeof(int));
+    if (posix_memalign((void **) &queue_data, DIRECT_IO_ALIGN, (size_t) queue_max * BLOCK_SIZE) != 0 ||
+        posix_memalign((void **) &queue_run, DIRECT_IO_ALIGN, (size_t) queue_max * BLOCK_SIZE) != 0)
+    {
+        return -1;
+    }
+
+    queue_running = 1;
+    pthread_create(&queue_thread, NULL, queue_loop, NULL);
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Stops the timeout thread and writes out what is still queued     */
+/*----------------------------------------------------------------*/
+static void stop_write_queue()
+{
+    double done = disk_clock();
+
+    if (queue_addr == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    queue_running = 0;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&disk_lock);
+    pthread_join(queue_thread, NULL);
+
+    flush_write_queue(&done);
+
+    free(queue_addr);
+    free(queue_data);
+    free(queue_run);
+    queue_addr = NULL;
+    queue_data = NULL;
+    queue_run = NULL;
+}
+
+/*----------------------------------------------------------------*/
+/*Drops queued writes of blocks that are being discarded           */
+/*----------------------------------------------------------------*/
+static void queue_discard(int start_address, int nblocks)
+{
+    int i = 0;
+
+    while (i < queue_len)
+    {
+        if (queue_addr[i] >= start_address && queue_addr[i] < start_address + nblocks)
+        {
+            queue_len--;
+            queue_addr[i] = queue_addr[queue_len];
+            memcpy(queue_data + (size_t) i * BLOCK_SIZE, queue_data + (size_t) queue_len * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/*----------------------------------------------------------------*/
+/*Forgets the cache slots of blocks that are being discarded,      */
+/*dirty or not, so that they are never destaged.                   */
+/*----------------------------------------------------------------*/
+static void cache_discard(int start_address, int nblocks)
+{
+    int i, slot;
+
+    for (i = start_address; i < start_address + nblocks; i++)
+    {
+        slot = cache_slot_of[i];
+        if (slot == -1)
+        {
+            continue;
+        }
+        if (cache_map[slot].dirty)
+        {
+            cache_dirty_count--;
+        }
+        cache_map[slot].block = -1;
+        cache_map[slot].dirty = 0;
+        cache_slot_of[i] = -1;
+        cache_save_entry(slot);
+    }
+}
+
+/*----------------------------------------------------------------*/
+/*Tells the disk that a series of blocks is no longer in use. They */
+/*are dropped from the write queue and the cache tier, and holes   */
+/*are punched over them in the images, which keeps sparse images   */
+/*sparse. They may read back as zeros or as their old contents.    */
+/*----------------------------------------------------------------*/
+int discard_blocks(int start_address, int nblocks)
+{
+    int s;
+    double done = disk_clock();
+
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    if (trace_fp != NULL)
+    {
+        trace_request(DISK_DISCARD, start_address, nblocks);
+    }
+    if (queue_addr != NULL)
+    {
+        queue_discard(start_address, nblocks);
+    }
+    if (cache_map != NULL)
+    {
+        cache_discard(start_address, nblocks);
+    }
+    s = array_io(DISK_DISCARD, start_address, nblocks, NULL, &done);
+    pthread_mutex_unlock(&disk_lock);
+    return s;
+}
+
+/*----------------------------------------------------------------*/
+/*Write barrier: everything written so far reaches the disk before */
+/*anything written afterwards.                                     */
+/*----------------------------------------------------------------*/
+int flush_disk()
+{
+    double done = disk_clock();
+
+    pthread_mutex_lock(&disk_lock);
+    if (queue_addr != NULL)
+    {
+        flush_write_queue(&done);
+    }
+    pthread_mutex_unlock(&disk_lock);
+
+    wait_disk(done);
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Runs one request against the disk, then waits outside of the     */
+/*lock until the images it was queued on have served it.           */
+/*----------------------------------------------------------------*/
+static int disk_io(int is_write, int start_address, int nblocks, char *buffer)
+{
+    int s;
+    double done;
+
+    pthread_mutex_lock(&disk_lock);
+    done = disk_clock();
+
+    if (trace_fp != NULL)
+    {
+        trace_request(is_write, start_address, nblocks);
+    }
+
+    if (queue_addr == NULL)
+    {
+        s = lower_io(is_write, start_address, nblocks, buffer, &done);
+    }
+    else
+    {
+        if (queue_expired())
+        {
+            flush_write_queue(&done);
+        }
+        if (is_write)
+        {
+            s = queue_write(start_address, nblocks, buffer, &done);
+        }
+        else
+        {
+            s = queue_read(start_address, nblocks, buffer, &done);
+        }
+    }
+
+    if (is_write)
+    {
+        disk_stats.writes++;
+        disk_stats.blocks_written += nblocks;
+    }
+    else
+    {
+        disk_stats.reads++;
+        disk_stats.blocks_read += nblocks;
+    }
+    pthread_mutex_unlock(&disk_lock);
+
+    /*Pause until the request is done*/
+    wait_disk(done);
+    return s;
+}
+
+/*----------------------------------------------------------------*/
+/*Initializes a disk file filled with 0's. Each image is extended  */
+/*to its size as a sparse file; an image that cannot be extended   */
+/*that way is cleared through member_discard() instead.            */
+/*----------------------------------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    int i;
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+    /*Creates a new file*/
+    if (open_disk(filename, O_RDWR | O_CREAT | O_TRUNC) == -1)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        return -1;
+    }
+
+    /*Sizes every image, reading back as 0's without writing them*/
+    for (i = 0; i < num_members; i++)
+    {
+        if (ftruncate(members[i].fd, (off_t) members[i].num_blocks * BLOCK_SIZE) == -1
+            && member_discard(&members[i], 0, members[i].num_blocks) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (trace_name != NULL && start_disk_trace() == -1)
+    {
+        return -1;
+    }
+    if (cache_name != NULL && start_disk_cache(1) == -1)
+    {
+        return -1;
+    }
+    if (queue_max > 0)
+    {
+        return start_write_queue();
+    }
+    return 0;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    
+    /*Opens a file*/
+    if (open_disk(filename, O_RDWR) == -1)
+    {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+
+    if (trace_name != NULL && start_disk_trace() == -1)
+    {
+        return -1;
+    }
+    if (cache_name != NULL && start_disk_cache(0) == -1)
+    {
+        return -1;
+    }
+    if (queue_max > 0)
+    {
+        return start_write_queue();
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Reads every block requested straight into the caller's buffer when possible*/
+    return disk_io(0, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    return disk_io(1, start_address, nblocks, buffer);
+}
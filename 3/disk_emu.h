@@ -1,5 +1,57 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#include <stdint.h>
+
+/*Layouts of the emulated disk over its image files*/
+#define DISK_SINGLE 0
+#define DISK_STRIPED 1
+#define DISK_MIRRORED 2
+#define MAX_DISK_IMAGES 8
+
+/*I/O counters and the latency simulated so far*/
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long blocks_read;
+    unsigned long blocks_written;
+    double busy_usec;
+} disk_stats_t;
+
+/*Block I/O trace format: one header followed by one record per request*/
+#define DISK_TRACE_MAGIC 0x54524345
+#define DISK_TRACE_READ 0
+#define DISK_TRACE_WRITE 1
+#define DISK_TRACE_DISCARD 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t reserved;
+} disk_trace_header_t;
+
+typedef struct {
+    uint64_t usec;      /*time since the trace started*/
+    uint32_t address;
+    uint16_t nblocks;
+    uint8_t op;
+    uint8_t reserved;
+} disk_trace_record_t;
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int discard_blocks(int start_address, int nblocks);
 int close_disk();
+void set_disk_direct_io(int enable);
+void set_disk_latency(double block_usec, double seek_usec);
+int set_disk_array(int mode, int chunk_size, int nimages, char **filenames);
+void set_disk_cache(char *filename, int nslots);
+void set_disk_write_queue(int max_blocks, int timeout_ms);
+int flush_disk();
+void set_disk_trace(char *filename);
+void get_disk_stats(disk_stats_t *out);
+
+#endif
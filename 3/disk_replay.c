@@ -0,0 +1,226 @@
+/** @file disk_replay.c
+ *  @brief Replays a block I/O trace against the disk emulator
+ *
+ *  Reads a trace captured with `set_disk_trace()` and re-issues
+ *  every request against a freshly initialized emulated disk,
+ *  configured with any of the disk emulator options (latency model,
+ *  O_DIRECT, write queue, cache tier, striping or mirroring). It
+ *  then reports the throughput and the latency distribution of the
+ *  reads and writes, so that two configurations can be compared on
+ *  the same captured workload.
+ *
+ *  usage: disk_replay [-l block_usec] [-s seek_usec] [-d] [-t]
+ *                     [-q blocks] [-c cache_image:slots]
+ *                     [-r stripe|mirror] [-k chunk] trace image...
+ *
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "disk_emu.h"
+
+/** @struct latencies of one kind of request
+*/
+typedef struct {
+    unsigned long count;
+    unsigned long blocks;
+    unsigned long capacity;
+    double* usec;
+} replay_stats_t;
+
+/** @brief Helper function for timestamps
+ *
+ *  @return the monotonic clock in microseconds
+*/
+double now_usec() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+/** @brief Helper function for recording a request
+ *
+ *  @param st the stats of the request kind
+ *  @param nblocks size of the request
+ *  @param usec time the request took
+ *  @return void
+*/
+void record(replay_stats_t* st, int nblocks, double usec) {
+    if (st->count == st->capacity) {
+        st->capacity = st->capacity ? st->capacity * 2 : 1024;
+        st->usec = (double*) realloc(st->usec, st->capacity * sizeof(double));
+    }
+    st->usec[st->count++] = usec;
+    st->blocks += nblocks;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Helper function for printing one kind of request
+ *
+ *  @param name the label of the line
+ *  @param st the stats of the request kind
+ *  @param block_size size of a block in bytes
+ *  @param elapsed total replay time in microseconds
+ *  @return void
+*/
+void report(const char* name, replay_stats_t* st, int block_size, double elapsed) {
+    double total = 0;
+
+    if (st->count == 0) {
+        printf("%-6s %10d\n", name, 0);
+        return;
+    }
+
+    qsort(st->usec, st->count, sizeof(double), compare_doubles);
+    for (unsigned long i=0; i<st->count; i++) total += st->usec[i];
+
+    printf(
+        "%-6s %10lu %10.2f %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+        name,
+        st->count,
+        (double) st->blocks * block_size / elapsed,     // bytes per usec == MB/s
+        st->count / (elapsed / 1e6),
+        total / st->count,
+        st->usec[st->count / 2],
+        st->usec[(st->count * 99) / 100],
+        st->usec[st->count - 1]
+    );
+}
+
+void usage() {
+    printf("usage: disk_replay [-l block_usec] [-s seek_usec] [-d] [-t] [-q blocks]\n");
+    printf("                   [-c cache_image:slots] [-r stripe|mirror] [-k chunk] trace image...\n");
+    printf("  -t  keep the original timing between requests instead of replaying back to back\n");
+    printf("  -r  stripe or mirror the disk over the images, otherwise give exactly one image\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int direct = 0;
+    int timed = 0;
+    int queue_blocks = 0;
+    int chunk = 1;
+    int mode = DISK_SINGLE;
+    int cache_slots = 0;
+    char* cache_image = NULL;
+    double block_usec = 0;
+    double seek_usec = 0;
+
+    while ((opt = getopt(argc, argv, "l:s:dtq:c:r:k:")) != -1) {
+        switch (opt) {
+            case 'l': block_usec = atof(optarg); break;
+            case 's': seek_usec = atof(optarg); break;
+            case 'd': direct = 1; break;
+            case 't': timed = 1; break;
+            case 'q': queue_blocks = atoi(optarg); break;
+            case 'k': chunk = atoi(optarg); break;
+            case 'r':
+                if (strcmp(optarg, "stripe") == 0) mode = DISK_STRIPED;
+                else if (strcmp(optarg, "mirror") == 0) mode = DISK_MIRRORED;
+                else { usage(); return 1; }
+                break;
+            case 'c': {
+                char* colon = strchr(optarg, ':');
+                if (colon == NULL) { usage(); return 1; }
+                *colon = '\0';
+                cache_image = optarg;
+                cache_slots = atoi(colon + 1);
+                break;
+            }
+            default: usage(); return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    FILE* trace = fopen(argv[optind], "rb");
+    disk_trace_header_t header;
+    if (trace == NULL || fread(&header, sizeof(header), 1, trace) != 1 || header.magic != DISK_TRACE_MAGIC) {
+        printf("Could not read trace %s\n", argv[optind]);
+        return 1;
+    }
+
+    char** images = &argv[optind + 1];
+    int nimages = argc - optind - 1;
+
+    // a single disk has one image, and more would be silently ignored
+    if (mode == DISK_SINGLE && nimages > 1) {
+        printf("Extra images need -r stripe or -r mirror\n");
+        usage();
+        return 1;
+    }
+
+    set_disk_direct_io(direct);
+    set_disk_latency(block_usec, seek_usec);
+    if (mode != DISK_SINGLE && set_disk_array(mode, chunk, nimages, images) == -1) return 1;
+    if (cache_image != NULL) set_disk_cache(cache_image, cache_slots);
+    if (queue_blocks > 0) set_disk_write_queue(queue_blocks, 100);
+
+    if (init_fresh_disk(images[0], header.block_size, header.num_blocks) == -1) return 1;
+
+    int buffer_blocks = 64;
+    char* buffer = (char*) calloc(buffer_blocks, header.block_size);
+
+    replay_stats_t reads = {0};
+    replay_stats_t writes = {0};
+    disk_trace_record_t rec;
+
+    double start = now_usec();
+
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (rec.nblocks > buffer_blocks) {
+            buffer_blocks = rec.nblocks;
+            buffer = (char*) realloc(buffer, (size_t) buffer_blocks * header.block_size);
+            memset(buffer, 0, (size_t) buffer_blocks * header.block_size);
+        }
+
+        if (timed) {
+            double wait = start + rec.usec - now_usec();
+            if (wait > 0) usleep(wait);
+        }
+
+        double t = now_usec();
+        if (rec.op == DISK_TRACE_DISCARD) {
+            discard_blocks(rec.address, rec.nblocks);
+        } else if (rec.op == DISK_TRACE_WRITE) {
+            write_blocks(rec.address, rec.nblocks, buffer);
+            record(&writes, rec.nblocks, now_usec() - t);
+        } else {
+            read_blocks(rec.address, rec.nblocks, buffer);
+            record(&reads, rec.nblocks, now_usec() - t);
+        }
+    }
+
+    flush_disk();
+    double elapsed = now_usec() - start;
+
+    disk_stats_t st;
+    get_disk_stats(&st);
+
+    printf("replayed %lu requests in %.3f s, simulated disk time %.3f s\n",
+           reads.count + writes.count, elapsed / 1e6, st.busy_usec / 1e6);
+    printf("%-6s %10s %10s %10s %10s %10s %10s %10s\n",
+           "op", "requests", "MB/s", "ops/s", "avg us", "p50 us", "p99 us", "max us");
+    report("read", &reads, header.block_size, elapsed);
+    report("write", &writes, header.block_size, elapsed);
+
+    close_disk();
+    fclose(trace);
+    free(buffer);
+    free(reads.usec);
+    free(writes.usec);
+    return 0;
+}
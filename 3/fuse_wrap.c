@@ -0,0 +1,533 @@
+#define FUSE_USE_VERSION 30
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_cache.h"
+
+/*
+ *  FUSE may open the same file several times, but SFS hands out a
+ *  single descriptor per file. Every open file gets a handle whose
+ *  index is stored in fi->fh; handles of the same file share the SFS
+ *  descriptor, which stays open until the last of them is released.
+ *  fd is -1 once the file has been removed underneath the handle.
+*/
+typedef struct {
+    int refs;
+    int fd;
+    char name[MAX_FILENAME];
+    pthread_mutex_t lock;
+} handle_t;
+
+static handle_t handles[NUM_INODES];
+
+/*
+ *  FUSE runs its multithreaded loop unless mounted with -s. Requests
+ *  that change the directory or the handle table take ns_lock for
+ *  writing; reads and writes take it for reading plus the lock of
+ *  their handle, which is per file, so I/O on different files runs in
+ *  parallel inside SFS. The workers semaphore caps how many reads and
+ *  writes are in flight at once (--workers=N, 1 means single-threaded).
+*/
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static sem_t workers;
+static int num_workers = 8;
+
+/*
+ *  The file system is formatted or reattached in .init, once FUSE has
+ *  mounted and daemonized: the disk emulator's background threads would
+ *  not survive the fork, and a bad command line never touches the image.
+ *  --format makes a fresh file system and --mount-existing reattaches the
+ *  one on disk without rescanning it; by default an existing image is
+ *  reattached. .destroy flushes and closes the disk on unmount. The
+ *  image lives in the directory we were started from, which daemonizing
+ *  leaves, so .init moves back there first. If the image cannot be
+ *  mounted, .init ends the session and we exit with an error.
+*/
+static int format_disk = -1;
+static char image_dir[4096];
+static int mount_failed = 0;
+
+/*
+ *  Every sfs_fwrite flushes the i-node table and bitmap,
+ *  so we ask the kernel for requests as large as it will send instead
+ *  of 4 KB pages (--max-write=N, libfuse 2 caps it at 128 KB), and
+ *  let it read ahead by as much.
+*/
+static unsigned int max_request = 128 * 1024;
+
+/*
+ *  Every change to the image goes through this mount, so the kernel
+ *  always knows when its cached attributes, names and pages go stale
+ *  and there is nothing to invalidate from our side. We let it keep
+ *  them for --cache-timeout=N seconds (0 keeps the FUSE defaults) and
+ *  keep file pages across opens. The writeback cache stays off: it
+ *  flushes dirty pages in any order, and SFS cannot write past the end
+ *  of a file.
+*/
+static int cache_timeout = 60;
+
+/*
+ *  --buffer-cache=N puts a write-back buffer cache of N blocks under
+ *  SFS (see sfs_cache.h): writes return once they are in memory and a
+ *  flusher thread writes them back in the background. The default of
+ *  0 writes everything through. fsync writes the cache back.
+*/
+static int buffer_blocks = 0;
+
+/*
+ *  --backend=emu|pread|mmap|ram picks the block device (see blockdev.h).
+ *  A RAM disk is loaded from the image when reattached and is never
+ *  written back to it.
+*/
+static char *backend = "emu";
+
+static int find_handle(const char *path)
+{
+    int i;
+    
+    for (i = 0; i < NUM_INODES; i++) {
+        if (handles[i].refs > 0 && handles[i].fd != -1 && strcmp(handles[i].name, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+    int h, fd;
+    char filename[MAX_FILENAME];
+    
+    if (strlen(path) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    
+    if ((h = find_handle(path)) != -1) {
+        handles[h].refs++;
+        fi->fh = h;
+        return 0;
+    }
+    
+    for (h = 0; h < NUM_INODES && handles[h].refs > 0; h++);
+    if (h == NUM_INODES)
+        return -ENFILE;
+    
+    strcpy(filename, path);
+    fd = sfs_fopen(filename);
+    if (fd == -1)
+        return -ENFILE;
+    
+    handles[h].refs = 1;
+    handles[h].fd = fd;
+    strcpy(handles[h].name, path);
+    fi->fh = h;
+    return 0;
+}
+
+/* points the handles of path at a new descriptor, -1 when the file is gone */
+static void rebind_handles(const char *path, int fd)
+{
+    int i;
+    
+    for (i = 0; i < NUM_INODES; i++) {
+        if (handles[i].refs > 0 && handles[i].fd != -1 && strcmp(handles[i].name, path) == 0)
+            handles[i].fd = fd;
+    }
+}
+
+static int fuse_getattr(const char *path, struct stat *stbuf)
+{
+    int res = 0;
+    int size;
+    
+    memset(stbuf, 0, sizeof(struct stat));
+    
+    pthread_rwlock_rdlock(&ns_lock);
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else if((size = sfs_getfilesize(path)) != -1) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = size;
+    } else
+        res = -ENOENT;
+    pthread_rwlock_unlock(&ns_lock);
+    
+    return res;
+}
+
+/*
+ *  Entries are listed in batches straight from the directory table,
+ *  with their attributes filled in so that a listing needs no getattr
+ *  per file. Offsets are directory slots (after "." and ".."), so the
+ *  kernel can resume a listing where the previous buffer filled up.
+*/
+static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t offset, struct fuse_file_info *fi)
+{
+    sfs_dirent_t entries[16];
+    struct stat st;
+    int i, n, pos;
+    
+    if (strcmp(path, "/") != 0)
+        return -ENOENT;
+    
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = S_IFDIR | 0755;
+    st.st_nlink = 2;
+    if (offset < 1 && filler(buf, ".", &st, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", &st, 2))
+        return 0;
+    
+    st.st_mode = S_IFREG | 0666;
+    st.st_nlink = 1;
+    pos = offset > 2 ? offset - 2 : 0;
+    
+    while ((n = sfs_readdir(&pos, entries, 16)) > 0) {
+        for (i = 0; i < n; i++) {
+            st.st_ino = entries[i].inode;
+            st.st_size = entries[i].size;
+            if (filler(buf, &entries[i].name[1], &st, entries[i].inode + 2))
+                return 0;
+        }
+    }
+    
+    return 0;
+}
+
+static int fuse_unlink(const char *path)
+{
+    int res;
+    char filename[MAX_FILENAME];
+    
+    if (strlen(path) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    
+    strcpy(filename, path);
+    pthread_rwlock_wrlock(&ns_lock);
+    res = sfs_remove(filename);
+    if (res != -1)
+        rebind_handles(path, -1);
+    pthread_rwlock_unlock(&ns_lock);
+    
+    return res == -1 ? -ENOENT : 0;
+}
+
+static int fuse_rename(const char *from, const char *to)
+{
+    int i;
+    char oldname[MAX_FILENAME];
+    char newname[MAX_FILENAME];
+    
+    if (strlen(from) >= MAX_FILENAME || strlen(to) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    
+    strcpy(oldname, from);
+    strcpy(newname, to);
+    
+    pthread_rwlock_wrlock(&ns_lock);
+    if (sfs_rename(oldname, newname) == -1) {
+        pthread_rwlock_unlock(&ns_lock);
+        return -ENOENT;
+    }
+    
+    /* the replaced file is gone, the renamed one keeps its descriptor */
+    rebind_handles(to, -1);
+    for (i = 0; i < NUM_INODES; i++) {
+        if (handles[i].refs > 0 && handles[i].fd != -1 && strcmp(handles[i].name, from) == 0)
+            strcpy(handles[i].name, to);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    
+    return 0;
+}
+
+static int fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+    
+    pthread_rwlock_wrlock(&ns_lock);
+    res = open_handle(path, fi);
+    pthread_rwlock_unlock(&ns_lock);
+    
+    fi->keep_cache = 1;
+    return res;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    handle_t *h = &handles[fi->fh];
+    
+    pthread_rwlock_wrlock(&ns_lock);
+    if (h->refs > 0 && --h->refs == 0 && h->fd != -1) {
+        sfs_fclose(h->fd);
+        h->fd = -1;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    
+    return 0;
+}
+
+static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    int res;
+    handle_t *h = &handles[fi->fh];
+    
+    sem_wait(&workers);
+    pthread_rwlock_rdlock(&ns_lock);
+    pthread_mutex_lock(&h->lock);
+    if (h->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pread(h->fd, buf, size, offset)) == -1)
+        res = 0;
+    pthread_mutex_unlock(&h->lock);
+    pthread_rwlock_unlock(&ns_lock);
+    sem_post(&workers);
+    
+    return res;
+}
+
+static int fuse_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+    handle_t *h = &handles[fi->fh];
+    
+    sem_wait(&workers);
+    pthread_rwlock_rdlock(&ns_lock);
+    pthread_mutex_lock(&h->lock);
+    if (h->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pwrite(h->fd, buf, size, offset)) == -1)
+        res = -EINVAL;
+    pthread_mutex_unlock(&h->lock);
+    pthread_rwlock_unlock(&ns_lock);
+    sem_post(&workers);
+    
+    return res;
+}
+
+#if FUSE_VERSION >= 29
+/*
+ *  With splice, the data of a write arrives in a pipe rather than in
+ *  libfuse's buffer: copy it out once and hand it to SFS. A plain
+ *  memory buffer is passed through as is. There is no read_buf, since
+ *  SFS data never sits in a file descriptor we could splice from and
+ *  .read already fills the reply buffer directly.
+*/
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+        return fuse_write(path, buf->buf[0].mem, size, offset, fi);
+    
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL)
+        return -ENOMEM;
+    
+    res = fuse_buf_copy(&dst, buf, 0);
+    if (res >= 0)
+        res = fuse_write(path, dst.buf[0].mem, res, offset, fi);
+    
+    free(dst.buf[0].mem);
+    return res;
+}
+#endif
+
+static int fuse_truncate(const char *path, off_t size)
+{
+    char filename[MAX_FILENAME];
+    int h, fd;
+    int res = 0;
+    
+    if (strlen(path) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    
+    strcpy(filename, path);
+    pthread_rwlock_wrlock(&ns_lock);
+    if (sfs_getfilesize(filename) == -1) {
+        pthread_rwlock_unlock(&ns_lock);
+        return -ENOENT;
+    }
+    
+    /* shrink the file in place, through an open handle if there is one */
+    h = find_handle(path);
+    fd = h != -1 ? handles[h].fd : sfs_fopen(filename);
+    if (fd == -1)
+        res = -EIO;
+    else if (sfs_ftruncate(fd, size) == -1)
+        res = -EINVAL;
+    if (fd != -1 && h == -1)
+        sfs_fclose(fd);
+    pthread_rwlock_unlock(&ns_lock);
+    return res;
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return sfs_sync() == 0 ? 0 : -EIO;
+}
+
+static int fuse_statfs(const char *path, struct statvfs *stbuf)
+{
+    sfs_statfs_t st;
+    
+    if (sfs_statfs(&st) == -1)
+        return -EIO;
+    
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = st.block_size;
+    stbuf->f_frsize = st.block_size;
+    stbuf->f_blocks = st.total_blocks;
+    stbuf->f_bfree = st.free_blocks;
+    stbuf->f_bavail = st.free_blocks;
+    stbuf->f_files = st.total_inodes;
+    stbuf->f_ffree = st.free_inodes;
+    stbuf->f_favail = st.free_inodes;
+    stbuf->f_namemax = MAX_FILENAME - 2;
+    
+    return 0;
+}
+
+static int fuse_access(const char *path, int mask)
+{
+    return 0;
+}
+
+static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    return 0;
+}
+
+static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    return fuse_open(path, fi);
+}
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    if (chdir(image_dir) == -1)
+        perror(image_dir);
+    if (mksfs(format_disk == 1 || (format_disk == -1 && access(DISK_NAME, F_OK) != 0)) == -1) {
+        fprintf(stderr, "sfs: could not mount %s\n", DISK_NAME);
+        mount_failed = 1;
+        fuse_exit(fuse_get_context()->fuse);
+    }
+    
+#ifdef FUSE_CAP_BIG_WRITES
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+#endif
+    conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+    conn->max_write = max_request;
+    conn->max_readahead = max_request;
+    
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    if (!mount_failed)
+        sfs_unmount();
+}
+
+static struct fuse_operations xmp_oper = {
+    .getattr = fuse_getattr,
+    .readdir = fuse_readdir,
+    .mknod = fuse_mknod,
+    .unlink = fuse_unlink,
+    .rename = fuse_rename,
+    .truncate = fuse_truncate,
+    .open = fuse_open, 
+    .release = fuse_release,
+    .read = fuse_read, 
+    .write = fuse_write, 
+#if FUSE_VERSION >= 29
+    .write_buf = fuse_write_buf,
+#endif
+    .statfs = fuse_statfs,
+    .fsync = fuse_fsync,
+    .access = fuse_access,
+    .create = fuse_create,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
+};
+
+int main(int argc, char *argv[])
+{
+    int i, n = 0, err;
+    char *fuse_argv[argc + 4];
+    char timeouts[96];
+    
+    /* --format, --mount-existing, --workers, --max-write, --cache-timeout, --buffer-cache and --backend are ours */
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0)
+            format_disk = 1;
+        else if (strcmp(argv[i], "--mount-existing") == 0)
+            format_disk = 0;
+        else if (strncmp(argv[i], "--workers=", 10) == 0)
+            num_workers = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--max-write=", 12) == 0)
+            max_request = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--cache-timeout=", 16) == 0)
+            cache_timeout = atoi(argv[i] + 16);
+        else if (strncmp(argv[i], "--buffer-cache=", 15) == 0)
+            buffer_blocks = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--backend=", 10) == 0)
+            backend = argv[i] + 10;
+        else
+            fuse_argv[n++] = argv[i];
+    }
+    if (num_workers < 1)
+        num_workers = 1;
+    if (getcwd(image_dir, sizeof(image_dir)) == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+    if (format_disk == 0 && access(DISK_NAME, F_OK) != 0) {
+        fprintf(stderr, "%s: no disk image %s to mount\n", argv[0], DISK_NAME);
+        return 1;
+    }
+    if (num_workers == 1)
+        fuse_argv[n++] = "-s";
+    if (cache_timeout > 0) {
+        snprintf(timeouts, sizeof(timeouts), "attr_timeout=%d,entry_timeout=%d,negative_timeout=%d",
+                cache_timeout, cache_timeout, cache_timeout);
+        fuse_argv[n++] = "-o";
+        fuse_argv[n++] = timeouts;
+    }
+    fuse_argv[n] = NULL;
+    
+    if (blockdev_by_name(backend) == NULL) {
+        fprintf(stderr, "%s: unknown backend %s\n", argv[0], backend);
+        return 1;
+    }
+    sfs_set_blockdev(blockdev_by_name(backend));
+    sfs_set_cache(buffer_blocks, 0, 0, 0);
+    sem_init(&workers, 0, num_workers);
+    for (i = 0; i < NUM_INODES; i++)
+        pthread_mutex_init(&handles[i].lock, NULL);
+    
+    err = fuse_main(n, fuse_argv, &xmp_oper, NULL);
+    return err ? err : mount_failed;
+}
@@ -0,0 +1,678 @@
+#define FUSE_USE_VERSION 30
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_cache.h"
+
+/*
+ *  The low-level API hands us node ids instead of paths, and we make
+ *  them the SFS i-node numbers: the root directory is i-node 0 and
+ *  FUSE_ROOT_ID, file i-node i is node i + 1. SFS reuses the i-node of
+ *  a removed file, so the upper 32 bits of a node id carry a generation
+ *  that is bumped when a file the kernel still knows about is removed,
+ *  and requests for an older generation fail with ESTALE. lookups counts
+ *  the references the kernel holds, handed out by lookup and create and
+ *  given back by forget.
+*/
+#define NODE_ID(ino) (((fuse_ino_t) generation[ino] << 32) | (fuse_ino_t) ((ino) + 1))
+#define NODE_INODE(node) ((int) ((node) & 0xffffffff) - 1)
+#define NODE_GENERATION(node) ((unsigned int) ((node) >> 32))
+
+static unsigned int generation[NUM_INODES];
+static unsigned long lookups[NUM_INODES];
+
+/*
+ *  SFS hands out a single descriptor per file, so every open of a file
+ *  shares one handle, whose index is stored in fi->fh. fd is -1 once
+ *  the file has been removed underneath the handle; the handle then
+ *  stays apart from any new file that reuses the i-node.
+*/
+typedef struct {
+    int refs;
+    int fd;
+    int ino;
+    pthread_mutex_t lock;
+} handle_t;
+
+static handle_t handles[NUM_INODES];
+
+/*
+ *  Same concurrency model as the path wrappers: requests that change
+ *  the directory, the handle table or the node tables take ns_lock for
+ *  writing, reads and writes take it for reading plus the lock of their
+ *  handle, and the workers semaphore caps the reads and writes in flight.
+*/
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static sem_t workers;
+static int num_workers = 8;
+
+/*
+ *  The file system is formatted or reattached in .init, once FUSE has
+ *  mounted and daemonized: the disk emulator's background threads would
+ *  not survive the fork, and a bad command line never touches the image.
+ *  --format makes a fresh file system and --mount-existing reattaches the
+ *  one on disk without rescanning it; by default an existing image is
+ *  reattached. .destroy flushes and closes the disk on unmount. The
+ *  image lives in the directory we were started from, which daemonizing
+ *  leaves, so .init moves back there first. If the image cannot be
+ *  mounted, .init ends the session and we exit with an error.
+*/
+static int format_disk = -1;
+static char image_dir[4096];
+static int mount_failed = 0;
+static unsigned int max_request = 128 * 1024;
+static double cache_timeout = 60;
+
+/*
+ *  --buffer-cache=N puts a write-back buffer cache of N blocks under
+ *  SFS, as in fuse_wrap.c; fsync writes it back.
+*/
+static int buffer_blocks = 0;
+
+/*
+ *  --backend=emu|pread|mmap|ram picks the block device (see blockdev.h).
+ *  A RAM disk is loaded from the image when reattached and is never
+ *  written back to it.
+*/
+static char *backend = "emu";
+
+/* SFS stores the names the path API gave it, with the leading slash */
+static int sfs_name(char *out, const char *name)
+{
+    if (strlen(name) + 1 >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+
+    out[0] = '/';
+    strcpy(out + 1, name);
+    return 0;
+}
+
+/* the i-node of a node id, or -1 when it is stale or gone */
+static int node_inode(fuse_ino_t node)
+{
+    int ino = NODE_INODE(node);
+
+    if (ino < 0 || ino >= NUM_INODES || NODE_GENERATION(node) != generation[ino])
+        return -1;
+    if (ino > 0 && sfs_getinodesize(ino) == -1)
+        return -1;
+    return ino;
+}
+
+static int fill_stat(int ino, struct stat *st)
+{
+    int size;
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = NODE_ID(ino);
+
+    if (ino == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else if ((size = sfs_getinodesize(ino)) != -1) {
+        st->st_mode = S_IFREG | 0666;
+        st->st_nlink = 1;
+        st->st_size = size;
+    } else
+        return -1;
+
+    return 0;
+}
+
+/* fills an entry for ino and takes a kernel reference on it */
+static int fill_entry(int ino, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (fill_stat(ino, &e->attr) == -1)
+        return -1;
+
+    e->ino = NODE_ID(ino);
+    e->generation = generation[ino];
+    e->attr_timeout = cache_timeout;
+    e->entry_timeout = cache_timeout;
+    lookups[ino]++;
+    return 0;
+}
+
+static int find_handle(int ino)
+{
+    int i;
+
+    for (i = 0; i < NUM_INODES; i++) {
+        if (handles[i].refs > 0 && handles[i].fd != -1 && handles[i].ino == ino)
+            return i;
+    }
+    return -1;
+}
+
+/* called once SFS has removed ino: its node id and handle go stale */
+static void drop_inode(int ino)
+{
+    int h;
+
+    if (lookups[ino] > 0) {
+        generation[ino]++;
+        lookups[ino] = 0;
+    }
+    if ((h = find_handle(ino)) != -1)
+        handles[h].fd = -1;
+}
+
+static int open_handle(int ino, struct fuse_file_info *fi)
+{
+    int h, fd;
+
+    if (ino == -1)
+        return -ESTALE;
+    if (ino == 0)
+        return -EISDIR;
+
+    if ((h = find_handle(ino)) != -1) {
+        handles[h].refs++;
+        fi->fh = h;
+        return 0;
+    }
+
+    for (h = 0; h < NUM_INODES && handles[h].refs > 0; h++);
+    if (h == NUM_INODES)
+        return -ENFILE;
+
+    fd = sfs_fopen_inode(ino);
+    if (fd == -1)
+        return -ENFILE;
+
+    handles[h].refs = 1;
+    handles[h].fd = fd;
+    handles[h].ino = ino;
+    fi->fh = h;
+    return 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    char filename[MAX_FILENAME];
+    int ino, res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((res = sfs_name(filename, name)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    ino = sfs_lookup(filename);
+    res = ino == -1 ? -1 : fill_entry(ino, &e);
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res == -1) {
+        /* a zero node id lets the kernel cache the miss */
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = cache_timeout;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t node, unsigned long nlookup)
+{
+    int ino = NODE_INODE(node);
+
+    pthread_rwlock_wrlock(&ns_lock);
+    if (ino >= 0 && ino < NUM_INODES && NODE_GENERATION(node) == generation[ino])
+        lookups[ino] -= nlookup < lookups[ino] ? nlookup : lookups[ino];
+    pthread_rwlock_unlock(&ns_lock);
+
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+    struct stat st;
+    int ino, res;
+
+    pthread_rwlock_rdlock(&ns_lock);
+    ino = node_inode(node);
+    res = ino == -1 ? -1 : fill_stat(ino, &st);
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res == -1)
+        fuse_reply_err(req, ESTALE);
+    else
+        fuse_reply_attr(req, &st, cache_timeout);
+}
+
+/* only the size can be set, and SFS files can only shrink */
+static void ll_setattr(fuse_req_t req, fuse_ino_t node, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    struct stat st;
+    int ino, h, fd;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&ns_lock);
+    ino = node_inode(node);
+
+    if (ino == -1)
+        res = ESTALE;
+    else if ((to_set & FUSE_SET_ATTR_SIZE) && ino == 0)
+        res = EISDIR;
+    else if (to_set & FUSE_SET_ATTR_SIZE) {
+        h = find_handle(ino);
+        fd = h != -1 ? handles[h].fd : sfs_fopen_inode(ino);
+        if (fd == -1)
+            res = EIO;
+        else if (sfs_ftruncate(fd, attr->st_size) == -1)
+            res = EINVAL;
+        if (fd != -1 && h == -1)
+            sfs_fclose(fd);
+    }
+
+    if (res == 0 && fill_stat(ino, &st) == -1)
+        res = ESTALE;
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res != 0)
+        fuse_reply_err(req, res);
+    else
+        fuse_reply_attr(req, &st, cache_timeout);
+}
+
+/* appends one entry to a readdir reply, returns 0 once the buffer is full */
+static int add_dirent(fuse_req_t req, char *buf, size_t size, size_t *used,
+        const char *name, const struct stat *st, off_t next)
+{
+    size_t len = fuse_add_direntry(req, buf + *used, size - *used, name, st, next);
+
+    if (len > size - *used)
+        return 0;
+    *used += len;
+    return 1;
+}
+
+/*
+ *  Entries come in batches straight from the directory table. Offsets
+ *  are directory slots (after "." and ".."), which never move, so a
+ *  listing resumes exactly where the previous reply filled up.
+*/
+static void ll_readdir(fuse_req_t req, fuse_ino_t node, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    sfs_dirent_t entries[16];
+    struct stat st;
+    char *buf;
+    size_t used = 0;
+    int i, n, pos;
+
+    if (node != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((buf = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = S_IFDIR;
+    st.st_ino = FUSE_ROOT_ID;
+    if ((offset >= 1 || add_dirent(req, buf, size, &used, ".", &st, 1)) &&
+            (offset >= 2 || add_dirent(req, buf, size, &used, "..", &st, 2))) {
+        st.st_mode = S_IFREG;
+        pos = offset > 2 ? offset - 2 : 0;
+
+        pthread_rwlock_rdlock(&ns_lock);
+        while ((n = sfs_readdir(&pos, entries, 16)) > 0) {
+            for (i = 0; i < n; i++) {
+                st.st_ino = NODE_ID(entries[i].inode);
+                if (!add_dirent(req, buf, size, &used, &entries[i].name[1], &st, entries[i].inode + 2))
+                    break;
+            }
+            if (i < n)
+                break;
+        }
+        pthread_rwlock_unlock(&ns_lock);
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char filename[MAX_FILENAME];
+    int ino;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((ino = sfs_name(filename, name)) != 0) {
+        fuse_reply_err(req, -ino);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    ino = sfs_remove(filename);
+    if (ino != -1)
+        drop_inode(ino);
+    pthread_rwlock_unlock(&ns_lock);
+
+    fuse_reply_err(req, ino == -1 ? ENOENT : 0);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname)
+{
+    char oldname[MAX_FILENAME];
+    char filename[MAX_FILENAME];
+    int src, dst, res;
+
+    if (parent != FUSE_ROOT_ID || newparent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (sfs_name(oldname, name) != 0 || sfs_name(filename, newname) != 0) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    src = sfs_lookup(oldname);
+    dst = sfs_lookup(filename);
+    res = sfs_rename(oldname, filename);
+
+    /* the renamed file keeps its i-node, so only the replaced one goes stale */
+    if (res == 0 && dst != -1 && dst != src)
+        drop_inode(dst);
+    pthread_rwlock_unlock(&ns_lock);
+
+    fuse_reply_err(req, res == -1 ? ENOENT : 0);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+    int ino, res;
+
+    pthread_rwlock_wrlock(&ns_lock);
+    ino = node_inode(node);
+    res = open_handle(ino, fi);
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    char filename[MAX_FILENAME];
+    int ino, fd, res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((res = sfs_name(filename, name)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    if ((ino = sfs_lookup(filename)) == -1) {
+        /* sfs_fopen creates the file, the handle then opens it by i-node */
+        if ((fd = sfs_fopen(filename)) != -1) {
+            sfs_fclose(fd);
+            ino = sfs_lookup(filename);
+        }
+    }
+
+    res = ino == -1 ? -ENOSPC : open_handle(ino, fi);
+    if (res == 0 && fill_entry(ino, &e) == -1)
+        res = -ESTALE;
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->keep_cache = 1;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+    handle_t *h = &handles[fi->fh];
+
+    pthread_rwlock_wrlock(&ns_lock);
+    if (h->refs > 0 && --h->refs == 0 && h->fd != -1) {
+        sfs_fclose(h->fd);
+        h->fd = -1;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+
+    fuse_reply_err(req, 0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t node, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    int res;
+    char *buf;
+    handle_t *h = &handles[fi->fh];
+
+    if ((buf = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    sem_wait(&workers);
+    pthread_rwlock_rdlock(&ns_lock);
+    pthread_mutex_lock(&h->lock);
+    if (h->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pread(h->fd, buf, size, offset)) == -1)
+        res = 0;
+    pthread_mutex_unlock(&h->lock);
+    pthread_rwlock_unlock(&ns_lock);
+    sem_post(&workers);
+
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t node, const char *buf,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+    handle_t *h = &handles[fi->fh];
+
+    sem_wait(&workers);
+    pthread_rwlock_rdlock(&ns_lock);
+    pthread_mutex_lock(&h->lock);
+    if (h->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pwrite(h->fd, buf, size, offset)) == -1)
+        res = -EINVAL;
+    pthread_mutex_unlock(&h->lock);
+    pthread_rwlock_unlock(&ns_lock);
+    sem_post(&workers);
+
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t node, int datasync, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, sfs_sync() == 0 ? 0 : EIO);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t node)
+{
+    struct statvfs stbuf;
+    sfs_statfs_t st;
+
+    if (sfs_statfs(&st) == -1) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    memset(&stbuf, 0, sizeof(struct statvfs));
+    stbuf.f_bsize = st.block_size;
+    stbuf.f_frsize = st.block_size;
+    stbuf.f_blocks = st.total_blocks;
+    stbuf.f_bfree = st.free_blocks;
+    stbuf.f_bavail = st.free_blocks;
+    stbuf.f_files = st.total_inodes;
+    stbuf.f_ffree = st.free_inodes;
+    stbuf.f_favail = st.free_inodes;
+    stbuf.f_namemax = MAX_FILENAME - 2;
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    struct fuse_session **se = userdata;
+
+    if (chdir(image_dir) == -1)
+        perror(image_dir);
+    if (mksfs(format_disk == 1 || (format_disk == -1 && access(DISK_NAME, F_OK) != 0)) == -1) {
+        fprintf(stderr, "sfs: could not mount %s\n", DISK_NAME);
+        mount_failed = 1;
+        fuse_session_exit(*se);
+    }
+
+#ifdef FUSE_CAP_BIG_WRITES
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+    conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+    conn->max_write = max_request;
+    conn->max_readahead = max_request;
+}
+
+static void ll_destroy(void *userdata)
+{
+    if (!mount_failed)
+        sfs_unmount();
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .readdir = ll_readdir,
+    .unlink = ll_unlink,
+    .rename = ll_rename,
+    .open = ll_open,
+    .create = ll_create,
+    .release = ll_release,
+    .read = ll_read,
+    .write = ll_write,
+    .statfs = ll_statfs,
+    .fsync = ll_fsync,
+};
+
+int main(int argc, char *argv[])
+{
+    int i, n = 0;
+    int multithreaded, foreground;
+    int err = -1;
+    char *mountpoint;
+    char *fuse_argv[argc + 1];
+    struct fuse_args args;
+    struct fuse_chan *ch;
+    struct fuse_session *se;
+
+    /* --format, --mount-existing, --workers, --max-write, --cache-timeout, --buffer-cache and --backend are ours */
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0)
+            format_disk = 1;
+        else if (strcmp(argv[i], "--mount-existing") == 0)
+            format_disk = 0;
+        else if (strncmp(argv[i], "--workers=", 10) == 0)
+            num_workers = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--max-write=", 12) == 0)
+            max_request = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--cache-timeout=", 16) == 0)
+            cache_timeout = atof(argv[i] + 16);
+        else if (strncmp(argv[i], "--buffer-cache=", 15) == 0)
+            buffer_blocks = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--backend=", 10) == 0)
+            backend = argv[i] + 10;
+        else
+            fuse_argv[n++] = argv[i];
+    }
+    fuse_argv[n] = NULL;
+    if (num_workers < 1)
+        num_workers = 1;
+    if (getcwd(image_dir, sizeof(image_dir)) == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+    if (format_disk == 0 && access(DISK_NAME, F_OK) != 0) {
+        fprintf(stderr, "%s: no disk image %s to mount\n", argv[0], DISK_NAME);
+        return 1;
+    }
+
+    if (blockdev_by_name(backend) == NULL) {
+        fprintf(stderr, "%s: unknown backend %s\n", argv[0], backend);
+        return 1;
+    }
+    sfs_set_blockdev(blockdev_by_name(backend));
+    sfs_set_cache(buffer_blocks, 0, 0, 0);
+    sem_init(&workers, 0, num_workers);
+    for (i = 0; i < NUM_INODES; i++)
+        pthread_mutex_init(&handles[i].lock, NULL);
+
+    args = (struct fuse_args) FUSE_ARGS_INIT(n, fuse_argv);
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+            (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), &se);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                if (multithreaded && num_workers > 1)
+                    err = fuse_session_loop_mt(se);
+                else
+                    err = fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+
+    return err || mount_failed ? 1 : 0;
+}
@@ -9,7 +9,13 @@
  *  @bug No known bugs.
  */
 
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sys/mman.h>
+
 #include "sfs_api.h"
+#include "sfs_cache.h"
 
 /*
  *  num_files and curr_file are global variables that keep track of the total 
@@ -21,13 +27,148 @@ unsigned int curr_file = 0;
 
 /* 
  *  Here, I am simply declaring my in-memory data 
- *  structures as global variables on the heap
+ *  structures as global variables on the heap. The 
+ *  tables are moved to and from the disk a whole 
+ *  block at a time, so they are rounded up to the 
+ *  blocks they occupy; the entries past the end are 
+ *  never used
 */
+#define TABLE_ENTRIES(type, nblocks) ((nblocks) * BLOCK_SIZE / sizeof(type))
+
 superblock_t super;
-inode_t inodes[NUM_INODES];
+inode_t inodes[TABLE_ENTRIES(inode_t, NUM_INODE_BLOCKS)];
 file_descriptor_t fdt[NUM_INODES];
-directory_entry_t root[NUM_FILE_INODES];
-bitmap_entry_t free_blocks[MAX_DATA_BLOCKS_SCALED_DOWN];
+directory_entry_t root[TABLE_ENTRIES(directory_entry_t, NUM_DATA_BLOCKS_FOR_DIR)];
+bitmap_entry_t free_blocks[TABLE_ENTRIES(bitmap_entry_t, NUM_DATA_BLOCKS_FOR_BITMAP)];
+
+/*
+ *  iostats counts every block we read or write, broken down by the 
+ *  operation that caused it (current_op) and the kind of block
+*/
+sfs_iostats_t iostats;
+__thread sfs_op_t current_op = SFS_OP_MKSFS;
+
+const char* op_names[SFS_NUM_OPS] = {"mksfs", "fopen", "fwrite", "fread", "remove", "rename", "truncate", "fadvise", "sync"};
+
+/*
+ *  current_priority is the buffer cache priority of the data blocks 
+ *  the current operation transfers, CACHE_NOREUSE for files that 
+ *  were advised SFS_FADV_NOREUSE
+*/
+__thread int current_priority = CACHE_NORMAL;
+const char* block_type_names[SFS_NUM_BLOCK_TYPES] = {"super", "inode", "dir", "bitmap", "indirect", "data"};
+
+/*
+ *  sfs_lock guards every in-memory structure above. Each public call 
+ *  holds it through SFS_LOCK(), which releases it again when the call 
+ *  returns. It is recursive because some calls are built on others 
+ *  (sfs_fopen on sfs_getfilesize, sfs_remove on sfs_fclose). The data 
+ *  block transfers of sfs_fread and sfs_fwrite run with it dropped, so 
+ *  calls on different files overlap on the disk; calls on the same file 
+ *  must be serialized by the caller.
+*/
+pthread_mutex_t sfs_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+ *  sfs_dev is the block device the file system is mounted on, 
+ *  every block goes to it through the buffer cache
+*/
+blockdev_t* sfs_dev = &blockdev_emu;
+
+/*
+ *  maps holds the mappings handed out by sfs_mmap(), addr is NULL 
+ *  for a free slot
+*/
+sfs_map_t maps[SFS_MAX_MAPS];
+
+void sfs_unlock(pthread_mutex_t** lock) {
+    pthread_mutex_unlock(*lock);
+}
+
+#define SFS_LOCK() \
+    pthread_mutex_t* sfs_held __attribute__((cleanup(sfs_unlock))) = \
+        (pthread_mutex_lock(&sfs_lock), &sfs_lock)
+
+/** @brief Helper function for starting an operation
+ * 
+ *  begin_op() makes the following disk accesses count 
+ *  towards the given operation and records the logical 
+ *  number of bytes the caller asked for.
+ * 
+ *  @param op the operation being started
+ *  @param bytes_requested logical size of the request
+ *  @return void
+*/
+void begin_op(sfs_op_t op, int bytes_requested) {
+    current_op = op;
+    current_priority = CACHE_NORMAL;
+    iostats.ops[op].calls += 1;
+    if (bytes_requested > 0) iostats.ops[op].bytes_requested += bytes_requested;
+}
+
+/** @brief Accounted wrapper around cache_read
+ * 
+ *  @param type the kind of block being read
+ *  @return the value returned by cache_read
+*/
+int io_read_blocks(sfs_block_type_t type, int start_address, int nblocks, void* buffer) {
+    iostats.ops[current_op].blocks_read[type] += nblocks;
+    return cache_read(start_address, nblocks, buffer, CACHE_NORMAL);
+}
+
+/** @brief Accounted wrapper around cache_write
+ * 
+ *  @param type the kind of block being written
+ *  @return the value returned by cache_write
+*/
+int io_write_blocks(sfs_block_type_t type, int start_address, int nblocks, void* buffer) {
+    iostats.ops[current_op].blocks_written[type] += nblocks;
+    return cache_write(start_address, nblocks, buffer, CACHE_NORMAL);
+}
+
+/** @brief Accounted data block read without the file system lock
+ * 
+ *  The block was found through the caller's i-node, which no other 
+ *  call can change while the caller is serialized on its file, so 
+ *  the transfer itself can run while other files use the lock.
+ * 
+ *  @return the value returned by cache_read
+*/
+int io_read_data(int start_address, int nblocks, void* buffer) {
+    iostats.ops[current_op].blocks_read[BLOCK_DATA] += nblocks;
+
+    pthread_mutex_unlock(&sfs_lock);
+    int res = cache_read(start_address, nblocks, buffer, current_priority);
+    pthread_mutex_lock(&sfs_lock);
+    return res;
+}
+
+/** @brief Accounted data block write without the file system lock
+ * 
+ *  @return the value returned by cache_write
+*/
+int io_write_data(int start_address, int nblocks, void* buffer) {
+    iostats.ops[current_op].blocks_written[BLOCK_DATA] += nblocks;
+
+    pthread_mutex_unlock(&sfs_lock);
+    int res = cache_write(start_address, nblocks, buffer, current_priority);
+    pthread_mutex_lock(&sfs_lock);
+    return res;
+}
+
+/** @brief Data block readahead without the file system lock
+ * 
+ *  The blocks only go into the buffer cache. They are not charged 
+ *  to the operation until it actually reads them.
+ * 
+ *  @return the value returned by cache_prefetch
+*/
+int io_prefetch_data(int start_address, int nblocks) {
+    pthread_mutex_unlock(&sfs_lock);
+    int res = cache_prefetch(start_address, nblocks, current_priority);
+    pthread_mutex_lock(&sfs_lock);
+    return res;
+}
 
 /** @brief Helper function for initializing Superblock
  * 
@@ -38,32 +179,281 @@ bitmap_entry_t free_blocks[MAX_DATA_BLOCKS_SCALED_DOWN];
 */
 void init_super()
 {
-    super.magic = 0xACBD0005;
+    super.magic = SFS_MAGIC;
     super.block_size = BLOCK_SIZE;
     super.inode_table_len = NUM_INODE_BLOCKS;
     super.root_dir_inode = 0;
     super.fs_size = BLOCK_SIZE * NUM_TOTAL_BLOCKS;
+    super.free_block_cnt = MAX_DATA_BLOCKS_SCALED_DOWN;
+    super.free_inode_cnt = NUM_FILE_INODES;
+    super.clean = 0;
 }
 
-/** @brief Helper function for finding free data blocks
+/** @brief Helper function for flushing the Superblock
  * 
- *  get_free_bitmap_address scans through the bitmap vector 
- *  to find the address of a free data block. It returns -1 
- *  if it cannot find a free data block.
+ *  write_super() copies the superblock into a zeroed block-sized 
+ *  buffer before writing it, so that we never write whatever 
+ *  happens to sit after the struct in memory onto the disk.
  * 
- *  @return index of the free position in bitmap array
+ *  @return void
 */
-int get_free_bitmap_address() {
-    int bitmap_entry = -1;
-    for (int i=0; i<MAX_DATA_BLOCKS_SCALED_DOWN; i++) {
-        if (free_blocks[i] == 0) {
-            bitmap_entry = i;
-            break;
+void write_super()
+{
+    char buff[BLOCK_SIZE] = "";
+    memcpy(buff, &super, sizeof(super));
+    io_write_blocks(BLOCK_SUPER, 0, 1, (void*) buff);
+}
+
+/** @brief Helper function for loading the Superblock
+ * 
+ *  read_super() is the reverse of write_super(). The free counters 
+ *  are only kept in memory while mounted and written out by 
+ *  sfs_sync() and sfs_unmount(), so unless the file system was 
+ *  cleanly unmounted we rebuild them from the bitmap and the i-node 
+ *  table. This also upgrades images written before the counters 
+ *  existed, which carry an older magic number. The superblock is 
+ *  then marked as mounted on the disk. This must be called after 
+ *  the i-node table and bitmap have been loaded.
+ * 
+ *  @return 1 if the file system was not cleanly unmounted, 0 otherwise
+*/
+int read_super()
+{
+    char buff[BLOCK_SIZE] = "";
+    io_read_blocks(BLOCK_SUPER, 0, 1, (void*) buff);
+    memcpy(&super, buff, sizeof(super));
+
+    int unclean = super.magic != SFS_MAGIC || !super.clean;
+
+    if (unclean) {
+        super.magic = SFS_MAGIC;
+        super.free_block_cnt = 0;
+        super.free_inode_cnt = 0;
+
+        for (int i=0; i<MAX_DATA_BLOCKS_SCALED_DOWN; i++) {
+            if (free_blocks[i] == 0) super.free_block_cnt += 1;
         }
+        for (int i=1; i<NUM_INODES; i++) {
+            if (inodes[i].link_cnt == 0) super.free_inode_cnt += 1;
+        }
+    }
+
+    super.clean = 0;
+    write_super();
+    return unclean;
+}
+
+/*
+ *  The free data blocks are also kept in a buddy allocator so that 
+ *  we can hand out contiguous runs without scanning the bitmap. 
+ *  buddy_head[k] links the free chunks of 2^k blocks that start at 
+ *  a multiple of 2^k, buddy_order[i] is k if block i heads such a 
+ *  chunk and -1 otherwise. The lists are never written to disk, 
+ *  buddy_rebuild() derives them from the bitmap at mount time.
+*/
+#define BUDDY_ORDERS 12
+
+int buddy_head[BUDDY_ORDERS];
+int buddy_next[MAX_DATA_BLOCKS_SCALED_DOWN];
+int buddy_prev[MAX_DATA_BLOCKS_SCALED_DOWN];
+signed char buddy_order[MAX_DATA_BLOCKS_SCALED_DOWN];
+
+/** @brief Helper function for linking a free chunk
+ * 
+ *  @param start first bitmap entry of the chunk
+ *  @param order the chunk holds 2^order blocks
+ *  @return void
+*/
+void buddy_push(int start, int order) {
+    buddy_order[start] = order;
+    buddy_prev[start] = -1;
+    buddy_next[start] = buddy_head[order];
+    if (buddy_head[order] != -1) buddy_prev[buddy_head[order]] = start;
+    buddy_head[order] = start;
+}
+
+/** @brief Helper function for unlinking a free chunk
+ * 
+ *  @param start first bitmap entry of the chunk
+ *  @return void
+*/
+void buddy_unlink(int start) {
+    int order = buddy_order[start];
+
+    if (buddy_prev[start] != -1) buddy_next[buddy_prev[start]] = buddy_next[start];
+    else buddy_head[order] = buddy_next[start];
+    if (buddy_next[start] != -1) buddy_prev[buddy_next[start]] = buddy_prev[start];
+
+    buddy_order[start] = -1;
+}
+
+/** @brief Helper function for returning a chunk to the buddy lists
+ * 
+ *  buddy_free() merges the chunk with its buddy, the chunk of the 
+ *  same size it was split from, for as long as that buddy is free 
+ *  as a whole, so freed space goes back to the largest runs possible.
+ * 
+ *  @param start first bitmap entry of the chunk
+ *  @param order the chunk holds 2^order blocks
+ *  @return void
+*/
+void buddy_free(int start, int order) {
+    while (order < BUDDY_ORDERS - 1) {
+        int buddy = start ^ (1 << order);
+        if (buddy >= MAX_DATA_BLOCKS_SCALED_DOWN || buddy_order[buddy] != order) break;
+
+        buddy_unlink(buddy);
+        if (buddy < start) start = buddy;
+        order += 1;
     }
+    buddy_push(start, order);
+}
+
+/** @brief Helper function for taking a chunk from the buddy lists
+ * 
+ *  buddy_alloc() takes the smallest free chunk of at least 2^order 
+ *  blocks and splits it in halves down to the requested size, 
+ *  putting the unused halves back on their lists.
+ * 
+ *  @param order the chunk must hold 2^order blocks
+ *  @return first bitmap entry of the chunk or -1
+*/
+int buddy_alloc(int order) {
+    int k = order;
+    while (k < BUDDY_ORDERS && buddy_head[k] == -1) k++;
+    if (k == BUDDY_ORDERS) return -1;
+
+    int start = buddy_head[k];
+    buddy_unlink(start);
+
+    while (k > order) {
+        k -= 1;
+        buddy_push(start + (1 << k), k);
+    }
+    return start;
+}
+
+/** @brief Helper function for freeing a range of bitmap entries
+ * 
+ *  Splits [first, end) into the largest aligned chunks that fit 
+ *  and hands each of them to buddy_free().
+ * 
+ *  @param first first bitmap entry of the range
+ *  @param end one past the last bitmap entry of the range
+ *  @return void
+*/
+void buddy_free_range(int first, int end) {
+    while (first < end) {
+        int order = 0;
+        while (
+            order < BUDDY_ORDERS - 1 &&
+            first % (2 << order) == 0 &&
+            first + (2 << order) <= end
+        ) order++;
+
+        buddy_free(first, order);
+        first += 1 << order;
+    }
+}
+
+/** @brief Helper function for rebuilding the buddy lists
+ * 
+ *  buddy_rebuild() throws the lists away and refills them with 
+ *  every run of free entries in the bitmap. It is called whenever 
+ *  the bitmap has been (re)initialized, i.e. in mksfs().
+ * 
+ *  @return void
+*/
+void buddy_rebuild() {
+    for (int k=0; k<BUDDY_ORDERS; k++) buddy_head[k] = -1;
+    memset(buddy_order, -1, sizeof(buddy_order));
+
+    int i = 0;
+    while (i < MAX_DATA_BLOCKS_SCALED_DOWN) {
+        if (free_blocks[i]) { i++; continue; }
+
+        int first = i;
+        while (i < MAX_DATA_BLOCKS_SCALED_DOWN && free_blocks[i] == 0) i++;
+        buddy_free_range(first, i);
+    }
+}
+
+/** @brief Helper function for allocating a data block
+ * 
+ *  alloc_data_block() takes a single free data block from the 
+ *  buddy lists, marks it as taken and keeps the superblock free 
+ *  block counter in sync.
+ * 
+ *  @return index of the allocated position in bitmap array or -1
+*/
+int alloc_data_block() {
+    int bitmap_entry = buddy_alloc(0);
+    if (bitmap_entry == -1) return -1;
+
+    free_blocks[bitmap_entry] = 1;
+    super.free_block_cnt -= 1;
+    return bitmap_entry;
+}
+
+/** @brief Helper function for allocating contiguous data blocks
+ * 
+ *  alloc_data_run() takes a free chunk of the next power of two 
+ *  at or above count blocks, gives the tail it does not need back 
+ *  and marks the rest as taken.
+ * 
+ *  @param count number of blocks in the run
+ *  @return index of the first position of the run in bitmap array or -1
+*/
+int alloc_data_run(int count) {
+    int order = 0;
+    while ((1 << order) < count) order++;
+    if (order >= BUDDY_ORDERS) return -1;
+
+    int bitmap_entry = buddy_alloc(order);
+    if (bitmap_entry == -1) return -1;
+
+    buddy_free_range(bitmap_entry + count, bitmap_entry + (1 << order));
+    memset(&free_blocks[bitmap_entry], 1, count);
+    super.free_block_cnt -= count;
     return bitmap_entry;
 }
 
+/* largest run take_run_block() asks the buddy lists for */
+#define MAX_RUN_BLOCKS 64
+
+/** @brief Helper function for freeing a data block
+ * 
+ *  free_data_block() is the reverse of alloc_data_block(). 
+ *  Freeing an entry that is already free is a no-op so the 
+ *  counter can never drift from the bitmap.
+ * 
+ *  @param bitmap_entry index of the position in bitmap array
+ *  @return void
+*/
+void free_data_block(int bitmap_entry) {
+    if (free_blocks[bitmap_entry] == 0) return;
+
+    free_blocks[bitmap_entry] = 0;
+    super.free_block_cnt += 1;
+    buddy_free(bitmap_entry, 0);
+}
+
+/** @brief Choose the block device to mount on
+ * 
+ *  `sfs_set_blockdev(blockdev_t* dev)` makes the following calls to 
+ *  mksfs() format or attach the file system on dev instead of the 
+ *  disk emulator. It must not be called while a file system is mounted.
+ * 
+ *  @param dev the block device, see blockdev.h
+ *  @return void
+*/
+void sfs_set_blockdev(blockdev_t* dev) {
+    SFS_LOCK();
+    sfs_dev = dev;
+}
+
+void recover_directory();
+
 /** @brief Initializes the file system
  * 
  *  `mksfs(int fresh)` initializes the disk either as a fresh file system 
@@ -73,20 +463,27 @@ int get_free_bitmap_address() {
  *  the disk in the right positions. If I am loading an existing disk file, 
  *  then I simply do the reverse: read the raw data from the disk since I 
  *  know their starting addresses and load them into the corresponding 
- *  in-memory data structures.
+ *  in-memory data structures. The I/O counters start from zero on 
+ *  every mount.
  * 
  *  @param fresh to initialize disk from scratch or load from file
- *  @return Void
+ *  @return 0 on success and -1 if the disk could not be opened
 */
-void mksfs(int fresh) {
+int mksfs(int fresh) {
+    SFS_LOCK();
+    memset(&iostats, 0, sizeof(iostats));
+    begin_op(SFS_OP_MKSFS, 0);
+    cache_stop();
+
     if (fresh) {
         init_super();
 
+        // forget the block pointers a previous mount may have left behind
+        memset(inodes, 0, sizeof(inodes));
         for (int i=1; i<NUM_INODES; i++) {
-            inodes[i].link_cnt = 0;
             fdt[i].inode = -1;
             memset(root[i-1].names, 0, MAX_FILENAME);
-            root[i-1].mode = 0;
+            root[i-1].mode = DIR_FREE;
         }
 
         num_files = 0;
@@ -95,20 +492,30 @@ void mksfs(int fresh) {
         fdt[0].rwptr = 0;
         inodes[0].link_cnt = 1;
         memset(free_blocks, 0, sizeof(free_blocks));
+        buddy_rebuild();
 
-        init_fresh_disk(DISK_NAME, BLOCK_SIZE, NUM_TOTAL_BLOCKS);
-        write_blocks(0, 1, &super);
-        write_blocks(1, NUM_INODE_BLOCKS, inodes);
-        write_blocks(1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
-        write_blocks(BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+        if (sfs_dev->open(sfs_dev, DISK_NAME, BLOCK_SIZE, NUM_TOTAL_BLOCKS, 1) == -1) {
+            printf("Could not create disk %s on the %s device\n", DISK_NAME, sfs_dev->name);
+            return -1;
+        }
+        cache_start(sfs_dev);
+        write_super();
+        io_write_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+        io_write_blocks(BLOCK_DIR, 1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+        io_write_blocks(BLOCK_BITMAP, BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
 
     } else {
-        init_disk(DISK_NAME, BLOCK_SIZE, NUM_TOTAL_BLOCKS);
+        if (sfs_dev->open(sfs_dev, DISK_NAME, BLOCK_SIZE, NUM_TOTAL_BLOCKS, 0) == -1) {
+            printf("Could not open disk %s on the %s device\n", DISK_NAME, sfs_dev->name);
+            return -1;
+        }
+        cache_start(sfs_dev);
 
-        read_blocks(0, 1, &super);
-        read_blocks(1, NUM_INODE_BLOCKS, inodes);
-        read_blocks(1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
-        read_blocks(BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+        io_read_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+        io_read_blocks(BLOCK_DIR, 1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+        io_read_blocks(BLOCK_BITMAP, BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+        int unclean = read_super();
+        buddy_rebuild();
 
         curr_file = 0;
         num_files = 0;
@@ -121,7 +528,11 @@ void mksfs(int fresh) {
 
         fdt[0].inode = 0;
         fdt[0].rwptr = 0;
+
+        if (unclean) recover_directory();
     }
+
+    return 0;
 }
 
 /** @brief Gets next filename in directory
@@ -138,11 +549,12 @@ void mksfs(int fresh) {
  *  @return 1 for exit success and 0 otherwise
 */
 int sfs_getnextfilename(char* fname) {
+    SFS_LOCK();
     if (num_files > 0) {
         int counter = 0;
 
         for (int i=0; i<NUM_FILE_INODES; i++) {
-            if (root[i].mode != 1) continue;
+            if (root[i].mode != DIR_IN_USE) continue;
             if (counter == curr_file) {
                 strcpy(fname, root[i].names);
                 curr_file += 1;
@@ -156,6 +568,40 @@ int sfs_getnextfilename(char* fname) {
     return 0;
 }
 
+/** @brief Read a batch of directory entries
+ * 
+ *  `sfs_readdir(int* pos, sfs_dirent_t* entries, int max)` copies up to 
+ *  `max` files, with their i-node number and size, out of the directory 
+ *  table in one pass. `pos` is a slot of the directory table: the scan 
+ *  starts there and leaves `pos` after the last slot returned, so a 
+ *  listing can be resumed from any call. Files never move between slots, 
+ *  so removing or creating files between two calls does not make the 
+ *  listing skip or repeat the others. Unlike `sfs_getnextfilename()` it 
+ *  keeps no global cursor, so several listings can run at once.
+ * 
+ *  @param pos directory slot to start at, updated for the next call
+ *  @param entries array to fill with the files found
+ *  @param max capacity of the array
+ *  @return the number of entries filled, 0 at the end of the directory
+*/
+int sfs_readdir(int* pos, sfs_dirent_t* entries, int max) {
+    SFS_LOCK();
+    int count = 0;
+    int i = *pos < 0 ? 0 : *pos;
+
+    for (; i<NUM_FILE_INODES && count < max; i++) {
+        if (root[i].mode != DIR_IN_USE) continue;
+
+        strcpy(entries[count].name, root[i].names);
+        entries[count].inode = i + 1;
+        entries[count].size = inodes[i+1].size;
+        count += 1;
+    }
+
+    *pos = i;
+    return count;
+}
+
 /** @brief Get the file size at given path
  * 
  *  `sfs_getfilesize(const char* path)` is the simplest method to implement. 
@@ -168,6 +614,7 @@ int sfs_getnextfilename(char* fname) {
  *  @return size of file at path in bytes
 */
 int sfs_getfilesize(const char* path) {
+    SFS_LOCK();
     int size = -1;
 
     for (int i=0; i<NUM_FILE_INODES; i++) {
@@ -184,6 +631,22 @@ int sfs_getfilesize(const char* path) {
     return size;
 }
 
+/** @brief Helper function for clearing the advice of a descriptor
+ * 
+ *  reset_advice() puts a newly opened descriptor back to the 
+ *  default access pattern, with no readahead done yet.
+ * 
+ *  @param f the file descriptor to reset
+ *  @return void
+*/
+void reset_advice(file_descriptor_t* f) {
+    f->advice = SFS_FADV_NORMAL;
+    f->noreuse = 0;
+    f->ra_window = 0;
+    f->ra_end = 0;
+    f->last_end = 0;
+}
+
 /** @brief Open a file in append mode 
  * 
  *  `sfs_open(char *name)` first checks if the given filename is already created 
@@ -199,6 +662,9 @@ int sfs_getfilesize(const char* path) {
  *  @return file descriptor of file on success and -1 on failure
 */
 int sfs_fopen(char* name) {
+    SFS_LOCK();
+    begin_op(SFS_OP_OPEN, 0);
+
     size_t length = strlen(name);
     if (length >= MAX_FILENAME) return -1;
 
@@ -216,7 +682,8 @@ int sfs_fopen(char* name) {
             
             fdt[free_fd].inode = i+1;
             fdt[free_fd].rwptr = sfs_getfilesize(name); // sets pointer after last byte of data
-            root[i].mode = 1;
+            reset_advice(&fdt[free_fd]);
+            root[i].mode = DIR_IN_USE;
             inodes[i+1].link_cnt = 1;
             return free_fd;
         }
@@ -229,17 +696,19 @@ int sfs_fopen(char* name) {
                 if (f->inode == -1) {
                     f->inode = i;
                     f->rwptr = 0;
+                    reset_advice(f);
 
                     num_files += 1;
+                    super.free_inode_cnt -= 1;
                     inodes[i].link_cnt = 1;
                     inodes[i].mode = 1;
                     inodes[i].size = 0;
 
                     strcpy(root[i-1].names, name);
-                    root[i-1].mode = 1;
+                    root[i-1].mode = DIR_IN_USE;
 
-                    write_blocks(1, NUM_INODE_BLOCKS, inodes);
-                    write_blocks(1+NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+                    io_write_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+                    io_write_blocks(BLOCK_DIR, 1+NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
 
                     return j;
                 }
@@ -261,6 +730,7 @@ int sfs_fopen(char* name) {
  *  @return 0 on success and -1 on failure
 */
 int sfs_fclose(int fileID) {
+    SFS_LOCK();
     if (fileID > 0 && fileID < NUM_INODES) {
         file_descriptor_t* f = &fdt[fileID];
         if (f->inode != -1) {
@@ -272,6 +742,42 @@ int sfs_fclose(int fileID) {
     return -1;
 }
 
+/** @brief Helper function for allocating the data blocks of a write
+ * 
+ *  take_run_block() hands out the blocks of a contiguous run one at 
+ *  a time, so that a file extended by one large write ends up laid 
+ *  out sequentially on disk. When the run is used up it allocates a 
+ *  new one sized for the rest of the write, up to MAX_RUN_BLOCKS, and 
+ *  settles for smaller runs when free space is fragmented.
+ * 
+ *  @param run the next and end bitmap entries of the current run
+ *  @param wanted number of blocks the write still has to allocate
+ *  @return index of the allocated position in bitmap array or -1
+*/
+int take_run_block(int run[2], int wanted) {
+    if (run[0] < run[1]) return run[0]++;
+
+    if (wanted > MAX_RUN_BLOCKS) wanted = MAX_RUN_BLOCKS;
+    for (int count=wanted; count>0; count/=2) {
+        int start = alloc_data_run(count);
+        if (start == -1) continue;
+
+        run[0] = start + 1;
+        run[1] = start + count;
+        return start;
+    }
+    return -1;
+}
+
+/** @brief Helper function for giving back the unused part of a run
+ * 
+ *  @param run the next and end bitmap entries of the current run
+ *  @return void
+*/
+void release_run(int run[2]) {
+    while (run[0] < run[1]) free_data_block(run[0]++);
+}
+
 /** @brief Write contents of buffer to file
  * 
  *  `sfs_fwrite(int fileID, const char* buf, int length)` first uses the 
@@ -281,8 +787,8 @@ int sfs_fclose(int fileID) {
  *  blocks when we reach the end of the current block. Depending on if we are 
  *  overwriting existing file data or extending the existing file, the method 
  *  will appropriately allocate new data blocks using a helper method 
- *  `get_free_bitmap_address()` that scans through the bitmap array to find 
- *  unused data blocks. The method will also help us allocate an intermediate 
+ *  `take_run_block()` that takes contiguous runs of unused data blocks 
+ *  from the buddy allocator. The method will also help us allocate an intermediate 
  *  data block for the indirect pointer that we can subsequently fill with direct 
  *  pointers to point to data blocks. Finally, `sfs_fwrite` will also appropriately 
  *  update all metadata fields in the i-node (size, pointers) and move the 
@@ -294,6 +800,9 @@ int sfs_fclose(int fileID) {
  *  @return the number of bytes written to disk
 */
 int sfs_fwrite(int fileID, const char* buf, int length) {
+    SFS_LOCK();
+    begin_op(SFS_OP_WRITE, length);
+
     int bytes_written = 0;
     int bytes_to_write = length;
     file_descriptor_t* f = &fdt[fileID];
@@ -306,7 +815,10 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
         f->rwptr >= (MAX_DATA_BLOCKS_PER_FILE * BLOCK_SIZE)
     ) return 0;
 
+    if (f->noreuse) current_priority = CACHE_NOREUSE;
+
     int bitmap_entry;
+    int run[2] = {0, 0};
     int did_write_to_disk = 1;
     int current_block = f->rwptr / BLOCK_SIZE;
     int rwptr_size_offset = -(inodes[f->inode].size - f->rwptr);
@@ -317,7 +829,7 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
     unsigned int ptr_buff[NUM_POINTERS_IN_INDIRECT - 1];
 
     if (node->indirect > 0 && !did_load_ptr_buff) {
-        read_blocks(node->indirect, 1, (void*) ptr_buff);
+        io_read_blocks(BLOCK_INDIRECT, node->indirect, 1, (void*) ptr_buff);
         did_load_ptr_buff = 1;
     }
 
@@ -330,27 +842,38 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
         did_write_to_disk = 0;
 
         char buff[BLOCK_SIZE] = "";
+
+        int block_offset = f->rwptr % BLOCK_SIZE;
+        int bytes_count = BLOCK_SIZE - block_offset;
+        if (bytes_to_write <= bytes_count) bytes_count = bytes_to_write;
+
+        // a write covering the whole block never needs the old contents
+        int whole_block = (bytes_count == BLOCK_SIZE);
+
+        // blocks from here to the end of the write, in case we must allocate
+        int blocks_wanted = (f->rwptr + bytes_to_write - 1) / BLOCK_SIZE - current_block + 1;
+        if (blocks_wanted > MAX_DATA_BLOCKS_PER_FILE - 1 - current_block) {
+            blocks_wanted = MAX_DATA_BLOCKS_PER_FILE - 1 - current_block;
+        }
         
         if (current_block < NUM_DIRECT_POINTERS) {
             if (node->direct[current_block] > 0) {
-                read_blocks(node->direct[current_block], 1, (void*) buff);
+                if (!whole_block) io_read_data(node->direct[current_block], 1, (void*) buff);
                 bitmap_entry = node->direct[current_block] - DATA_BLOCKS_OFFSET;
             } else {
-                if ((bitmap_entry = get_free_bitmap_address()) == -1) {
+                if ((bitmap_entry = take_run_block(run, blocks_wanted)) == -1) {
                     printf("Fatal error could not allocate empty data block.\n");
                     break;
                 }
-                free_blocks[bitmap_entry] = 1;
                 node->direct[current_block] = bitmap_entry + DATA_BLOCKS_OFFSET;
             }
         } else {
             if (node->indirect <= 0) {
                 int ptr_bitmap_entry;
-                if ((ptr_bitmap_entry = get_free_bitmap_address()) == -1) {
+                if ((ptr_bitmap_entry = alloc_data_block()) == -1) {
                     printf("Fatal error could not allocate empty data block.\n");
                     break;
                 }
-                free_blocks[ptr_bitmap_entry] = 1;
                 memset(ptr_buff, 0, sizeof(ptr_buff));
 
                 did_load_ptr_buff = 1;
@@ -364,27 +887,26 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
 
             int ptr_address = current_block-NUM_DIRECT_POINTERS;
             if (ptr_buff[ptr_address] > 0) {
-                read_blocks(ptr_buff[ptr_address], 1, (void*) buff);
+                if (!whole_block) io_read_data(ptr_buff[ptr_address], 1, (void*) buff);
                 bitmap_entry = ptr_buff[ptr_address] - DATA_BLOCKS_OFFSET;
             } else {
-                if ((bitmap_entry = get_free_bitmap_address()) == -1) {
+                if ((bitmap_entry = take_run_block(run, blocks_wanted)) == -1) {
                     printf("Fatal error could not allocate empty data block.\n");
                     break;
                 }
-                free_blocks[bitmap_entry] = 1;
                 ptr_buff[ptr_address] = bitmap_entry + DATA_BLOCKS_OFFSET;
             }
         }
 
-        int block_offset = f->rwptr % BLOCK_SIZE;
-        int bytes_count = BLOCK_SIZE - block_offset;
-        if (bytes_to_write <= bytes_count) bytes_count = bytes_to_write;
-
         if (bytes_count > 0) {
-            memcpy(buff+block_offset, buf+bytes_written, bytes_count);
-            write_blocks(bitmap_entry + DATA_BLOCKS_OFFSET, 1, (void*) buff);
+            if (whole_block) {
+                // aligned full block: hand the caller's buffer straight to the disk
+                io_write_data(bitmap_entry + DATA_BLOCKS_OFFSET, 1, (void*) (buf+bytes_written));
+            } else {
+                memcpy(buff+block_offset, buf+bytes_written, bytes_count);
+                io_write_data(bitmap_entry + DATA_BLOCKS_OFFSET, 1, (void*) buff);
+            }
 
-            free_blocks[bitmap_entry] = 1;
             rwptr_size_offset += bytes_count;
             f->rwptr += bytes_count;
             bytes_to_write -= bytes_count;
@@ -395,19 +917,127 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
         }
     }
 
+    release_run(run);
+
     if (bytes_to_write != length) {
         // we did write to data blocks, so we must update file metadata
         if (rwptr_size_offset > 0) node->size += rwptr_size_offset;
-        if (did_load_ptr_buff) write_blocks(node->indirect, 1, (void*) ptr_buff);
+        if (did_load_ptr_buff) io_write_blocks(BLOCK_INDIRECT, node->indirect, 1, (void*) ptr_buff);
 
-        write_blocks(1, NUM_INODE_BLOCKS, inodes);
-        write_blocks(BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+        io_write_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+        io_write_blocks(BLOCK_BITMAP, BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
     }
 
     return bytes_written;
 }
 
 
+/* readahead window of a sequential reader, in blocks */
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 32
+
+/** @brief Helper function for finding the data blocks of a file
+ * 
+ *  collect_file_blocks() looks up the disk addresses of the data 
+ *  blocks of the i-node from block index `first` up to `last`, 
+ *  stopping early at the end of the file.
+ * 
+ *  @param n the i-node of the file
+ *  @param first index of the first data block
+ *  @param last index one past the last data block
+ *  @param blocks filled with the disk addresses
+ *  @return number of addresses found
+*/
+int collect_file_blocks(inode_t* n, int first, int last, int* blocks) {
+    unsigned int ptr_buff[NUM_POINTERS_IN_INDIRECT - 1];
+    int did_load_ptr_buff = 0;
+    int count = 0;
+
+    int file_blocks = (n->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (last > file_blocks) last = file_blocks;
+    if (last > MAX_DATA_BLOCKS_PER_FILE - 1) last = MAX_DATA_BLOCKS_PER_FILE - 1;
+
+    for (int i=first; i<last; i++) {
+        unsigned int block_address = 0;
+
+        if (i < NUM_DIRECT_POINTERS) {
+            block_address = n->direct[i];
+        } else {
+            if (!did_load_ptr_buff && n->indirect > 0) {
+                io_read_blocks(BLOCK_INDIRECT, n->indirect, 1, (void*) ptr_buff);
+                did_load_ptr_buff = 1;
+            }
+            if (did_load_ptr_buff) block_address = ptr_buff[i - NUM_DIRECT_POINTERS];
+        }
+
+        if (block_address == 0) break;
+        blocks[count++] = block_address;
+    }
+
+    return count;
+}
+
+/** @brief Helper function for prefetching part of a file
+ * 
+ *  prefetch_file_blocks() reads the data blocks of the i-node from 
+ *  index `first` up to `last` into the buffer cache, with one request 
+ *  per run of blocks that are adjacent on disk.
+ * 
+ *  @return void
+*/
+void prefetch_file_blocks(inode_t* n, int first, int last) {
+    int blocks[MAX_DATA_BLOCKS_PER_FILE];
+    int count = collect_file_blocks(n, first, last, blocks);
+
+    for (int i=0, run; i<count; i+=run) {
+        for (run=1; i+run < count && blocks[i+run] == blocks[i] + run; run++);
+        io_prefetch_data(blocks[i], run);
+    }
+}
+
+/** @brief Helper function for reading ahead of a reader
+ * 
+ *  readahead() is called by sfs_fread() before it reads blocks `first` 
+ *  to `last` of the file. A read that starts where the previous one 
+ *  stopped is sequential: the window starts at READAHEAD_MIN_BLOCKS 
+ *  and doubles on every readahead up to READAHEAD_MAX_BLOCKS, or a 
+ *  sixteenth of the buffer cache if that is less, so that readers of 
+ *  several files do not evict each other's blocks before using them. 
+ *  Any other read closes the window again. Files advised SEQUENTIAL 
+ *  start at the largest window, which for them is twice as large, 
+ *  and files advised RANDOM get none. 
+ *  Without the buffer cache there is nowhere to read ahead into. 
+ *  The next readahead starts once the reader is half a window away 
+ *  from the end of the last one, so blocks are fetched in large runs 
+ *  instead of one at a time.
+ * 
+ *  @param f the descriptor being read
+ *  @param n the i-node of the file
+ *  @return void
+*/
+void readahead(file_descriptor_t* f, inode_t* n, int first, int last) {
+    int max_window = f->advice == SFS_FADV_SEQUENTIAL ? 2 * READAHEAD_MAX_BLOCKS : READAHEAD_MAX_BLOCKS;
+    if (max_window > cache_size() / 16) max_window = cache_size() / 16;
+    if (max_window < READAHEAD_MIN_BLOCKS || f->advice == SFS_FADV_RANDOM) return;
+
+    if (f->rwptr != f->last_end) {
+        f->ra_window = 0;
+        f->ra_end = first;
+    }
+
+    int window = f->ra_window > 0 ? f->ra_window : READAHEAD_MIN_BLOCKS;
+    if (f->advice == SFS_FADV_SEQUENTIAL) window = max_window;
+    else if (f->rwptr != f->last_end) return;
+
+    if (f->ra_end > last + 1 + window / 2) return;
+
+    int start = f->ra_end > first ? f->ra_end : first;
+    f->ra_end = last + 1 + window;
+    prefetch_file_blocks(n, start, f->ra_end);
+
+    f->ra_window = window * 2 <= max_window ? window * 2 : window;
+}
+
 /** @brief Read data from file
  * 
  *  `sfs_fread(int fileID, char* buf, int length)` uses the same ideas presented 
@@ -424,6 +1054,9 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
  *  @return the actual of data read in bytes
 */
 int sfs_fread(int fileID, char* buf, int length) {
+    SFS_LOCK();
+    begin_op(SFS_OP_READ, length);
+
     int bytes_read = 0;
     int bytes_to_read = length;
     file_descriptor_t* f = &fdt[fileID];
@@ -434,6 +1067,8 @@ int sfs_fread(int fileID, char* buf, int length) {
         f->rwptr < 0 ||
         f->rwptr >= inodes[f->inode].size   // can't read after last byte of data
     ) return 0;
+
+    if (f->noreuse) current_priority = CACHE_NOREUSE;
     
     int did_write_to_buf = 1;
     int did_read_current_block;
@@ -443,6 +1078,7 @@ int sfs_fread(int fileID, char* buf, int length) {
     if (rwptr_size_offset < bytes_to_read) bytes_to_read = rwptr_size_offset;
 
     inode_t* node = &inodes[f->inode];
+    readahead(f, node, current_block, (f->rwptr + bytes_to_read - 1) / BLOCK_SIZE);
 
     int did_load_ptr_buff = 0;
     unsigned int ptr_buff[NUM_POINTERS_IN_INDIRECT - 1];
@@ -455,45 +1091,46 @@ int sfs_fread(int fileID, char* buf, int length) {
         did_write_to_buf = 0;
         did_read_current_block = 0;
 
-        char buff[BLOCK_SIZE] = "";
+        char buff[BLOCK_SIZE];
+        unsigned int block_address = 0;
+
+        int block_offset = f->rwptr % BLOCK_SIZE;
+        int bytes_count = BLOCK_SIZE - block_offset;
+        if (bytes_to_read <= bytes_count) bytes_count = bytes_to_read;
 
         if (current_block < NUM_DIRECT_POINTERS) {
-            if (node->direct[current_block] > 0) {
-                read_blocks(node->direct[current_block], 1, (void*) buff);
-                did_read_current_block = 1;
-            }
+            block_address = node->direct[current_block];
         } else {
             if (!did_load_ptr_buff && node->indirect > 0) {
-                read_blocks(node->indirect, 1, (void*) ptr_buff);
+                io_read_blocks(BLOCK_INDIRECT, node->indirect, 1, (void*) ptr_buff);
                 did_load_ptr_buff = 1;
             }
 
             int ptr_address = current_block-NUM_DIRECT_POINTERS;
-            if (did_load_ptr_buff && ptr_buff[ptr_address] > 0) {
-                read_blocks(ptr_buff[ptr_address], 1, (void*) buff);
-                did_read_current_block = 1;
-            }
+            if (did_load_ptr_buff) block_address = ptr_buff[ptr_address];
         }
 
-        if (did_read_current_block) {
-            int block_offset = f->rwptr % BLOCK_SIZE;
-            int bytes_count = BLOCK_SIZE - block_offset;
-
-            if (bytes_to_read <= bytes_count) bytes_count = bytes_to_read;
-            
-            if (bytes_count > 0) {
-                memcpy(buf + bytes_read, buff + block_offset, bytes_count);
+        if (block_address > 0 && bytes_count == BLOCK_SIZE) {
+            // aligned full block: read straight into the caller's buffer
+            io_read_data(block_address, 1, (void*) (buf + bytes_read));
+            did_read_current_block = 1;
+        } else if (block_address > 0) {
+            io_read_data(block_address, 1, (void*) buff);
+            memcpy(buf + bytes_read, buff + block_offset, bytes_count);
+            did_read_current_block = 1;
+        }
 
-                did_write_to_buf = 1;
-                bytes_read += bytes_count;
-                bytes_to_read -= bytes_count;
-                f->rwptr += bytes_count;
+        if (did_read_current_block) {
+            did_write_to_buf = 1;
+            bytes_read += bytes_count;
+            bytes_to_read -= bytes_count;
+            f->rwptr += bytes_count;
 
-                current_block = f->rwptr / BLOCK_SIZE;
-            }
+            current_block = f->rwptr / BLOCK_SIZE;
         }
     }
 
+    f->last_end = f->rwptr;
     return bytes_read;
 }
 
@@ -509,6 +1146,7 @@ int sfs_fread(int fileID, char* buf, int length) {
  *  @return 0 on success and -1 on failure
 */
 int sfs_fseek(int fileID, int loc) {
+    SFS_LOCK();
     if (fileID > 0 && fileID < NUM_INODES) {
         file_descriptor_t* f = &fdt[fileID];
         if (
@@ -528,6 +1166,503 @@ int sfs_fseek(int fileID, int loc) {
     return -1;
 }
 
+int compare_block_addresses(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+/** @brief Helper function for discarding freed blocks
+ * 
+ *  discard_blocks_batch() sorts the addresses of the blocks a call 
+ *  has freed and discards each run of adjacent ones with a single 
+ *  request, from the buffer cache and from the block device, which 
+ *  punches holes over them in the image.
+ * 
+ *  @param blocks disk addresses of the freed blocks, sorted in place
+ *  @param count number of addresses
+ *  @return void
+*/
+void discard_blocks_batch(int* blocks, int count) {
+    qsort(blocks, count, sizeof(int), compare_block_addresses);
+
+    for (int i=0, run; i<count; i+=run) {
+        for (run=1; i+run < count && blocks[i+run] == blocks[i] + run; run++);
+        cache_discard(blocks[i], run);
+        sfs_dev->discard(sfs_dev, blocks[i], run);
+    }
+}
+
+/** @brief Helper function for freeing the tail of a file
+ * 
+ *  truncate_blocks() deallocates every data block of the i-node from 
+ *  block index `first` onwards, direct or behind the indirect pointer, 
+ *  and clears the pointers to them. The indirect block itself is freed 
+ *  once it no longer holds any pointer. The i-node table and bitmap are 
+ *  left to the caller.
+ * 
+ *  @param n the i-node to shrink
+ *  @param first index of the first data block to free
+ *  @return void
+*/
+void truncate_blocks(inode_t* n, int first) {
+    unsigned int ptr_buff[NUM_POINTERS_IN_INDIRECT - 1];
+    int freed[MAX_DATA_BLOCKS_PER_FILE + 1];
+    int num_freed = 0;
+
+    for (int i=first; i<NUM_DIRECT_POINTERS; i++) {
+        if (n->direct[i] > 0) {
+            free_data_block(n->direct[i] - DATA_BLOCKS_OFFSET);
+            freed[num_freed++] = n->direct[i];
+        }
+
+        n->direct[i] = 0;
+    }
+
+    if (n->indirect > 0) {
+        int first_ptr = first > NUM_DIRECT_POINTERS ? first - NUM_DIRECT_POINTERS : 0;
+        io_read_blocks(BLOCK_INDIRECT, n->indirect, 1, (void*) ptr_buff);
+
+        for (int i=first_ptr; i<NUM_POINTERS_IN_INDIRECT-1; i++) {
+            if (ptr_buff[i] > 0) {
+                free_data_block(ptr_buff[i] - DATA_BLOCKS_OFFSET);
+                freed[num_freed++] = ptr_buff[i];
+            }
+
+            ptr_buff[i] = 0;
+        }
+
+        if (first_ptr == 0) {
+            free_data_block(n->indirect - DATA_BLOCKS_OFFSET);
+            freed[num_freed++] = n->indirect;
+            n->indirect = 0;
+        } else {
+            io_write_blocks(BLOCK_INDIRECT, n->indirect, 1, (void*) ptr_buff);
+        }
+    }
+
+    discard_blocks_batch(freed, num_freed);
+}
+
+/** @brief Helper function for releasing an i-node
+ * 
+ *  release_inode closes any file descriptor pointing to the given 
+ *  i-node, deallocates all of its data blocks through truncate_blocks() 
+ *  and clears its metadata. The i-node table and bitmap are flushed 
+ *  to the disk, but the directory table is left to the caller.
+ * 
+ *  @param inode the index of the i-node to release
+ *  @return void
+*/
+void release_inode(int inode) {
+    for (int j=1; j<NUM_INODES; j++) {
+        if (fdt[j].inode == inode) {
+            sfs_fclose(j);
+            break;
+        }
+    }
+
+    inode_t* n = &inodes[inode];
+    truncate_blocks(n, 0);
+
+    n->mode = 0;
+    n->size = 0;
+    n->link_cnt = 0;
+    num_files -= 1;
+    super.free_inode_cnt += 1;
+
+    io_write_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+    io_write_blocks(BLOCK_BITMAP, BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+}
+
+/** @brief Helper function for repairing the directory after a crash
+ * 
+ *  recover_directory() is called by mksfs() when the file system was 
+ *  not cleanly unmounted. An entry still marked DIR_REPLACED belongs to 
+ *  a rename that was interrupted: if another entry already carries its 
+ *  name the rename was committed and the marked entry is dropped, 
+ *  otherwise it never was and the entry is put back in use. Then every 
+ *  i-node whose directory entry is not in use is released. Those are 
+ *  files whose entry was cleared by sfs_rename() or sfs_remove(), or 
+ *  never written by sfs_fopen(), before the crash. Entries left in use 
+ *  for an i-node that sfs_remove() already released are cleared.
+ * 
+ *  @return void
+*/
+void recover_directory() {
+    int changed = 0;
+
+    for (int i=0; i<NUM_FILE_INODES; i++) {
+        if (root[i].mode != DIR_REPLACED) continue;
+
+        root[i].mode = DIR_IN_USE;
+        for (int j=0; j<NUM_FILE_INODES; j++) {
+            if (j != i && root[j].mode == DIR_IN_USE && strcmp(root[j].names, root[i].names) == 0) {
+                root[i].mode = DIR_FREE;
+                memset(root[i].names, 0, MAX_FILENAME);
+                break;
+            }
+        }
+        changed = 1;
+    }
+
+    for (int i=1; i<NUM_INODES; i++) {
+        if (inodes[i].link_cnt > 0 && root[i-1].mode != DIR_IN_USE) {
+            release_inode(i);
+            changed = 1;
+        } else if (inodes[i].link_cnt == 0 && root[i-1].mode == DIR_IN_USE) {
+            root[i-1].mode = DIR_FREE;
+            memset(root[i-1].names, 0, MAX_FILENAME);
+            changed = 1;
+        }
+    }
+
+    if (changed) io_write_blocks(BLOCK_DIR, 1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+}
+
+/** @brief Positional read
+ * 
+ *  `sfs_pread(int fileID, char* buf, int length, int loc)` moves the 
+ *  read-write pointer to `loc` and reads from there, so that callers 
+ *  holding a descriptor open across requests (like the FUSE wrapper) 
+ *  need one call per request. The pointer is left after the last byte read.
+ *  It takes no lock of its own, so the seek and the read are only atomic 
+ *  when the caller serializes its calls on the file, as the FUSE wrapper does.
+ * 
+ *  @param fileID file descriptor of the file to read from
+ *  @param buf char buffer to read data into
+ *  @param length amount of data to read in bytes
+ *  @param loc offset in the file to read from
+ *  @return the amount of data read in bytes or -1 if loc is invalid
+*/
+int sfs_pread(int fileID, char* buf, int length, int loc) {
+    if (sfs_fseek(fileID, loc) == -1) return -1;
+    return sfs_fread(fileID, buf, length);
+}
+
+/** @brief Positional write
+ * 
+ *  `sfs_pwrite(int fileID, const char* buf, int length, int loc)` is the 
+ *  write counterpart of `sfs_pread()`. Like `sfs_fwrite()`, it cannot 
+ *  leave a hole, so `loc` must not be past the end of the file.
+ * 
+ *  @param fileID file descriptor of the file to write to
+ *  @param buf the buffer that holds the content we wish to write to disk
+ *  @param length the amount of bytes in the buffer to write to disk
+ *  @param loc offset in the file to write at
+ *  @return the number of bytes written to disk or -1 if loc is invalid
+*/
+int sfs_pwrite(int fileID, const char* buf, int length, int loc) {
+    if (sfs_fseek(fileID, loc) == -1) return -1;
+    return sfs_fwrite(fileID, buf, length);
+}
+
+/** @brief Shrink an open file
+ * 
+ *  `sfs_ftruncate(int fileID, int length)` frees every data block past 
+ *  the new end of the file and updates its size in place, so the file 
+ *  keeps its i-node and any descriptor open on it. The read-write 
+ *  pointer is pulled back if it was past the new end. Files cannot 
+ *  have holes, so a file can never be grown this way.
+ * 
+ *  @param fileID the file descriptor of the file to shrink
+ *  @param length the new size of the file in bytes
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_ftruncate(int fileID, int length) {
+    SFS_LOCK();
+    begin_op(SFS_OP_TRUNCATE, 0);
+
+    if (fileID <= 0 || fileID >= NUM_INODES || fdt[fileID].inode <= 0) return -1;
+
+    file_descriptor_t* f = &fdt[fileID];
+    inode_t* n = &inodes[f->inode];
+
+    if (length < 0 || length > n->size) return -1;
+    if (length == n->size) return 0;
+
+    truncate_blocks(n, (length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    n->size = length;
+    if (f->rwptr > length) f->rwptr = length;
+
+    io_write_blocks(BLOCK_INODE, 1, NUM_INODE_BLOCKS, inodes);
+    io_write_blocks(BLOCK_BITMAP, BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+    return 0;
+}
+
+/** @brief Advise the file system how a file will be accessed
+ * 
+ *  `sfs_fadvise(int fileID, int offset, int length, int advice)` works 
+ *  like posix_fadvise. SFS_FADV_SEQUENTIAL and SFS_FADV_RANDOM set the 
+ *  access pattern of the descriptor, which sizes its readahead window 
+ *  (see readahead()), and SFS_FADV_NORMAL goes back to the default. 
+ *  SFS_FADV_NOREUSE makes the blocks the descriptor reads or writes 
+ *  the first ones the buffer cache evicts, so a one-pass scan of a big 
+ *  file does not push out everything else. These apply to the whole 
+ *  file. SFS_FADV_WILLNEED reads the given range into the buffer cache 
+ *  right away, and SFS_FADV_DONTNEED evicts the blocks fully inside it; 
+ *  dirty ones go as soon as they have been written back. A `length` of 
+ *  0 means up to the end of the file. Like sfs_fread(), it drops the 
+ *  lock while reading, so calls on the same file must be serialized.
+ * 
+ *  @param fileID the file descriptor of the file
+ *  @param offset start of the range in bytes
+ *  @param length length of the range in bytes, 0 for the rest of the file
+ *  @param advice one of the SFS_FADV_* values
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_fadvise(int fileID, int offset, int length, int advice) {
+    SFS_LOCK();
+    begin_op(SFS_OP_FADVISE, 0);
+
+    if (fileID <= 0 || fileID >= NUM_INODES || fdt[fileID].inode <= 0) return -1;
+    if (offset < 0 || length < 0) return -1;
+
+    file_descriptor_t* f = &fdt[fileID];
+    inode_t* n = &inodes[f->inode];
+    long end = length > 0 ? (long) offset + length : (long) MAX_DATA_BLOCKS_PER_FILE * BLOCK_SIZE;
+
+    switch (advice) {
+        case SFS_FADV_NORMAL:
+            reset_advice(f);
+            break;
+
+        case SFS_FADV_SEQUENTIAL:
+        case SFS_FADV_RANDOM:
+            f->advice = advice;
+            f->ra_window = 0;
+            break;
+
+        case SFS_FADV_NOREUSE:
+            f->noreuse = 1;
+            break;
+
+        case SFS_FADV_WILLNEED:
+            if (f->noreuse) current_priority = CACHE_NOREUSE;
+            prefetch_file_blocks(n, offset / BLOCK_SIZE, (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            break;
+
+        case SFS_FADV_DONTNEED: {
+            int blocks[MAX_DATA_BLOCKS_PER_FILE];
+            int count = collect_file_blocks(n, (offset + BLOCK_SIZE - 1) / BLOCK_SIZE, end / BLOCK_SIZE, blocks);
+
+            for (int i=0, run; i<count; i+=run) {
+                for (run=1; i+run < count && blocks[i+run] == blocks[i] + run; run++);
+                cache_drop(blocks[i], run);
+            }
+            break;
+        }
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/** @brief Find the i-node of a file
+ * 
+ *  Along with `sfs_getinodesize()` and `sfs_fopen_inode()`, this lets 
+ *  callers that already know a file by its i-node number (like the 
+ *  low-level FUSE frontend) skip the directory scan of the path calls.
+ * 
+ *  @param name the filename to look up
+ *  @return the i-node number of the file or -1 if it does not exist
+*/
+int sfs_lookup(const char* name) {
+    SFS_LOCK();
+    for (int i=0; i<NUM_FILE_INODES; i++) {
+        if (root[i].mode == DIR_IN_USE && strcmp(name, root[i].names) == 0) return i + 1;
+    }
+    return -1;
+}
+
+/** @brief Get the file size of an i-node
+ * 
+ *  @param inode the i-node number of the file
+ *  @return size of the file in bytes or -1 if there is no such file
+*/
+int sfs_getinodesize(int inode) {
+    SFS_LOCK();
+    if (inode <= 0 || inode >= NUM_INODES || inodes[inode].link_cnt == 0) return -1;
+    return inodes[inode].size;
+}
+
+/** @brief Open an existing file by i-node number
+ * 
+ *  Works like `sfs_fopen()` on an existing file: the read-write pointer 
+ *  starts at the end of the file, and a file that is already open 
+ *  cannot be opened a second time.
+ * 
+ *  @param inode the i-node number of the file
+ *  @return file descriptor of file on success and -1 on failure
+*/
+int sfs_fopen_inode(int inode) {
+    SFS_LOCK();
+    begin_op(SFS_OP_OPEN, 0);
+
+    if (inode <= 0 || inode >= NUM_INODES || inodes[inode].link_cnt == 0) return -1;
+
+    int free_fd = -1;
+    for (int j=1; j<NUM_INODES; j++) {
+        if (fdt[j].inode == inode) return -1;
+        if (free_fd == -1 && fdt[j].inode == -1) free_fd = j;
+    }
+
+    if (free_fd == -1) return -1;
+
+    fdt[free_fd].inode = inode;
+    fdt[free_fd].rwptr = inodes[inode].size;
+    reset_advice(&fdt[free_fd]);
+    return free_fd;
+}
+
+/** @brief Map part of a file into memory
+ * 
+ *  `sfs_mmap(int fileID, int offset, int length, int writable)` copies 
+ *  `length` bytes of the file starting at `offset` into fresh anonymous 
+ *  pages, using the regular read path once, and returns a pointer to 
+ *  them. Lookups into the mapping are then plain memory accesses instead 
+ *  of an `sfs_fread` each. Read-only mappings are write-protected. The 
+ *  changes made through a writable mapping reach the file on `sfs_msync()` 
+ *  or `sfs_munmap()`; since a file cannot grow through a mapping, the range 
+ *  must lie within the file. The descriptor must stay open while the 
+ *  mapping is written back, and its read-write pointer is left untouched.
+ * 
+ *  The mapping is a copy, not a view of the file: writes made to the file 
+ *  by other means after `sfs_mmap()` are not seen through it, and only the 
+ *  blocks changed through the mapping are written back over them.
+ * 
+ *  @param fileID the file descriptor of the file to map
+ *  @param offset offset in the file of the first mapped byte
+ *  @param length number of bytes to map
+ *  @param writable whether changes are to be written back
+ *  @return address of the mapping or NULL on failure
+*/
+void* sfs_mmap(int fileID, int offset, int length, int writable) {
+    SFS_LOCK();
+
+    if (fileID <= 0 || fileID >= NUM_INODES || fdt[fileID].inode <= 0) return NULL;
+    if (offset < 0 || length <= 0 || offset + length > (int) inodes[fdt[fileID].inode].size) return NULL;
+
+    int slot;
+    for (slot=0; slot<SFS_MAX_MAPS && maps[slot].addr != NULL; slot++);
+    if (slot == SFS_MAX_MAPS) return NULL;
+
+    char* addr = (char*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+
+    uint64_t rwptr = fdt[fileID].rwptr;
+    int bytes_read = sfs_pread(fileID, addr, length, offset);
+    fdt[fileID].rwptr = rwptr;
+
+    if (bytes_read != length || (!writable && mprotect(addr, length, PROT_READ) == -1)) {
+        munmap(addr, length);
+        return NULL;
+    }
+
+    // keep what was read, so that sfs_msync() can tell which blocks changed
+    char* synced = NULL;
+    if (writable) {
+        synced = (char*) malloc(length);
+        if (synced == NULL) {
+            munmap(addr, length);
+            return NULL;
+        }
+        memcpy(synced, addr, length);
+    }
+
+    maps[slot].addr = addr;
+    maps[slot].synced = synced;
+    maps[slot].fileID = fileID;
+    maps[slot].inode = fdt[fileID].inode;
+    maps[slot].offset = offset;
+    maps[slot].length = length;
+    maps[slot].writable = writable;
+    return addr;
+}
+
+/** @brief Helper function for finding a mapping by address
+ * 
+ *  @return the mapping or NULL if addr was not returned by sfs_mmap()
+*/
+sfs_map_t* find_map(void* addr) {
+    for (int i=0; i<SFS_MAX_MAPS; i++) {
+        if (addr != NULL && maps[i].addr == addr) return &maps[i];
+    }
+    return NULL;
+}
+
+/** @brief Write a mapping back to its file
+ * 
+ *  Read-only mappings have nothing to write. A writable mapping is 
+ *  compared with its contents as of the last write-back, one file block 
+ *  at a time, and each run of changed blocks is written back through the 
+ *  regular write path. It fails if the descriptor was closed or now 
+ *  points to another file.
+ * 
+ *  @param addr address returned by sfs_mmap()
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_msync(void* addr) {
+    SFS_LOCK();
+
+    sfs_map_t* m = find_map(addr);
+    if (m == NULL) return -1;
+    if (!m->writable) return 0;
+
+    file_descriptor_t* f = &fdt[m->fileID];
+    if (f->inode != m->inode || m->offset + m->length > (int) inodes[m->inode].size) return -1;
+
+    char* data = (char*) m->addr;
+    char* synced = (char*) m->synced;
+    uint64_t rwptr = f->rwptr;
+    int res = 0;
+
+    // pieces end on file block boundaries, so a changed piece is one block to write
+    int start = 0;
+    while (start < m->length && res == 0) {
+        int end = start;
+        do {
+            int next = ((m->offset + end) / BLOCK_SIZE + 1) * BLOCK_SIZE - m->offset;
+            if (next > m->length) next = m->length;
+            if (memcmp(data + end, synced + end, next - end) == 0) break;
+            end = next;
+        } while (end < m->length);
+
+        if (end > start) {
+            if (sfs_pwrite(m->fileID, data + start, end - start, m->offset + start) != end - start) res = -1;
+            else memcpy(synced + start, data + start, end - start);
+            start = end;
+        } else {
+            start = ((m->offset + start) / BLOCK_SIZE + 1) * BLOCK_SIZE - m->offset;
+        }
+    }
+
+    f->rwptr = rwptr;
+    return res;
+}
+
+/** @brief Remove a mapping
+ * 
+ *  Writable mappings are written back first. The memory is released 
+ *  even if the write-back fails.
+ * 
+ *  @param addr address returned by sfs_mmap()
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_munmap(void* addr) {
+    SFS_LOCK();
+
+    sfs_map_t* m = find_map(addr);
+    if (m == NULL) return -1;
+
+    int res = sfs_msync(addr);
+    munmap(m->addr, m->length);
+    free(m->synced);
+    m->addr = NULL;
+    m->synced = NULL;
+    return res;
+}
+
 /** @brief Close a file and remove it from the file system 
  * 
  *  `sfs_remove(char* file)` first cleans up the in-memory data structures 
@@ -536,70 +1671,256 @@ int sfs_fseek(int fileID, int loc) {
  *  data pointers (direct and indirect) and deallocates the corresponding 
  *  data blocks on the disk by clearing the data and setting the mapped char 
  *  in the free bitmap array back to 0. Finally, we flush all changes to the 
- *  disk and decrement the `num_files` global variable.
+ *  disk and decrement the `num_files` global variable. The i-node cleanup 
+ *  lives in the `release_inode()` helper so that `sfs_rename()` can reuse it.
  * 
  *  @param file the filename of file to remove
  *  @return the inode number of the removed file on success and -1 otherwise
 */
 int sfs_remove(char* file) {
+    SFS_LOCK();
+    begin_op(SFS_OP_REMOVE, 0);
 
     int inode = -1;
 
     for (int i=0; i<NUM_FILE_INODES; i++) {
         if (strcmp(root[i].names, file) == 0) {
             inode = i + 1;
-            root[i].mode = 0;
+            root[i].mode = DIR_FREE;
             memset(root[i].names, 0, MAX_FILENAME);
-
-            for (int j=1; j<NUM_INODES; j++) {
-                if (fdt[j].inode == inode) {
-                    sfs_fclose(j);
-                    break;
-                }
-            }
         }
     }
 
     if (inode > 0 && inodes[inode].link_cnt == 1) {
+        release_inode(inode);
+        io_write_blocks(BLOCK_DIR, 1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+    }
 
-        inode_t* n = &inodes[inode];
-        char buff[BLOCK_SIZE] = "";
-        unsigned int ptr_buff[NUM_POINTERS_IN_INDIRECT - 1];
+    return inode;
+}
 
-        for (int i=0; i<NUM_DIRECT_POINTERS; i++) {
-            if (n->direct[i] > 0) {
-                int bitmap_entry = n->direct[i] - DATA_BLOCKS_OFFSET;
-                free_blocks[bitmap_entry] = 0;
-                write_blocks(n->direct[i], 1, (void*) buff);
-            }
+/** @brief Helper function for writing directory entries
+ * 
+ *  @param first the first entry to write back
+ *  @param last the last entry to write back
+ *  @return void
+*/
+void write_dir_entries(int first, int last) {
+    int first_block = (first * sizeof(directory_entry_t)) / BLOCK_SIZE;
+    int last_block = (last * sizeof(directory_entry_t)) / BLOCK_SIZE;
+
+    io_write_blocks(
+        BLOCK_DIR,
+        1 + NUM_INODE_BLOCKS + first_block, 
+        last_block - first_block + 1, 
+        (char*) root + first_block * BLOCK_SIZE
+    );
+}
 
-            n->direct[i] = 0;
-        }
+/** @brief Helper function for a write barrier
+ * 
+ *  Everything written before it is on the disk once it returns.
+ * 
+ *  @return void
+*/
+void write_barrier() {
+    cache_sync();
+    sfs_dev->flush(sfs_dev);
+}
 
-        if (n->indirect > 0) {
-            read_blocks(n->indirect, 1, (void*) ptr_buff);
+/** @brief Rename a file in the root directory
+ * 
+ *  `sfs_rename(char* oldname, char* newname)` only rewrites the directory 
+ *  entry of the file, so its i-node and data blocks are left untouched. 
+ *  If `newname` already belongs to another file, that file is replaced. 
+ *  The commit point is the single block write that gives the renamed 
+ *  entry its new name, and the replaced file is only released after it. 
+ *  When both entries sit in the same directory block, that write also 
+ *  clears the replaced entry. Otherwise the replaced entry is first 
+ *  marked DIR_REPLACED behind a barrier, and cleared once the new name 
+ *  is on the disk. After a crash, mksfs() keeps the 
+ *  marked entry if the new name never made it and drops it if it did, 
+ *  and releases the i-node of a replaced file whose entry is gone (see 
+ *  recover_directory()). Either way a crash leaves either the old or 
+ *  the new name on disk, never both, and leaks no blocks.
+ * 
+ *  @param oldname the current filename
+ *  @param newname the filename to move the file to
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_rename(char* oldname, char* newname) {
+    SFS_LOCK();
+    begin_op(SFS_OP_RENAME, 0);
 
-            for (int i=0; i<NUM_POINTERS_IN_INDIRECT-1; i++) {
-                if (ptr_buff[i] > 0) {
-                    int bitmap_entry = ptr_buff[i] - DATA_BLOCKS_OFFSET;
-                    free_blocks[bitmap_entry] = 0;
-                    write_blocks(ptr_buff[i], 1, (void*) buff);
-                }
-            }
+    if (strlen(newname) >= MAX_FILENAME || strlen(newname) == 0) return -1;
 
-            write_blocks(n->indirect, 1, (void*) buff);
-            n->indirect = 0;
+    int src = -1;
+    int dst = -1;
+
+    for (int i=0; i<NUM_FILE_INODES; i++) {
+        if (root[i].mode != DIR_IN_USE) continue;
+        if (src == -1 && strcmp(root[i].names, oldname) == 0) src = i;
+        if (dst == -1 && strcmp(root[i].names, newname) == 0) dst = i;
+    }
+
+    if (src == -1) return -1;
+    if (src == dst) return 0;
+
+    int entries_per_block = BLOCK_SIZE / sizeof(directory_entry_t);
+    int same_block = dst != -1 && dst / entries_per_block == src / entries_per_block;
+
+    if (dst != -1 && !same_block) {
+        root[dst].mode = DIR_REPLACED;
+        write_dir_entries(dst, dst);
+        write_barrier();
+    }
+
+    memset(root[src].names, 0, MAX_FILENAME);
+    strcpy(root[src].names, newname);
+    if (same_block) {
+        root[dst].mode = DIR_FREE;
+        memset(root[dst].names, 0, MAX_FILENAME);
+    }
+    write_dir_entries(src, src);
+
+    if (dst == -1) return 0;
+
+    // the new name must be on disk before the replaced file goes away
+    write_barrier();
+
+    if (!same_block) {
+        root[dst].mode = DIR_FREE;
+        memset(root[dst].names, 0, MAX_FILENAME);
+        write_dir_entries(dst, dst);
+    }
+
+    if (inodes[dst+1].link_cnt == 1) release_inode(dst+1);
+
+    return 0;
+}
+
+/** @brief Report file system usage
+ * 
+ *  `sfs_statfs(sfs_statfs_t* st)` copies the free block and free i-node 
+ *  counters out of the superblock. These counters are updated on every 
+ *  allocation and free and flushed together with the rest of the metadata, 
+ *  so we never need to scan the bitmap to answer this.
+ * 
+ *  @param st the struct to fill with the usage counters
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_statfs(sfs_statfs_t* st) {
+    SFS_LOCK();
+    if (st == NULL) return -1;
+
+    st->block_size = super.block_size;
+    st->total_blocks = MAX_DATA_BLOCKS_SCALED_DOWN;
+    st->free_blocks = super.free_block_cnt;
+    st->total_inodes = NUM_FILE_INODES;
+    st->free_inodes = super.free_inode_cnt;
+    return 0;
+}
+
+/** @brief Copy the I/O accounting counters
+ * 
+ *  @param out the struct to copy the counters into
+ *  @return void
+*/
+void sfs_get_iostats(sfs_iostats_t* out) {
+    SFS_LOCK();
+    memcpy(out, &iostats, sizeof(iostats));
+}
+
+/** @brief Reset the I/O accounting counters
+ * 
+ *  @return void
+*/
+void sfs_reset_iostats() {
+    SFS_LOCK();
+    memset(&iostats, 0, sizeof(iostats));
+}
+
+/** @brief Print the I/O accounting report
+ * 
+ *  `sfs_print_iostats(FILE* out)` prints one line per operation with the 
+ *  blocks it read and wrote for every kind of block, followed by its write 
+ *  amplification: the bytes written to disk divided by the logical bytes 
+ *  the callers asked to write. For `sfs_fwrite` this shows how much of a 
+ *  small write is really spent on metadata. When the buffer cache is on, 
+ *  a last line shows how many of those blocks it absorbed.
+ * 
+ *  @param out the stream to print to
+ *  @return void
+*/
+void sfs_print_iostats(FILE* out) {
+    SFS_LOCK();
+    fprintf(out, "%-8s %8s %12s", "op", "calls", "bytes");
+    for (int t=0; t<SFS_NUM_BLOCK_TYPES; t++) fprintf(out, " %9s r/w", block_type_names[t]);
+    fprintf(out, " %10s\n", "write amp");
+
+    for (int op=0; op<SFS_NUM_OPS; op++) {
+        sfs_op_stats_t* o = &iostats.ops[op];
+        if (o->calls == 0) continue;
+
+        unsigned long written = 0;
+        fprintf(out, "%-8s %8lu %12lu", op_names[op], o->calls, o->bytes_requested);
+        for (int t=0; t<SFS_NUM_BLOCK_TYPES; t++) {
+            fprintf(out, " %6lu/%-6lu", o->blocks_read[t], o->blocks_written[t]);
+            written += o->blocks_written[t];
         }
 
-        n->mode = 0;
-        n->size = 0;
-        n->link_cnt = 0;
-        num_files -= 1;
+        if (op == SFS_OP_WRITE && o->bytes_requested > 0) {
+            fprintf(out, " %10.2f\n", (double) written * BLOCK_SIZE / o->bytes_requested);
+        } else {
+            fprintf(out, " %10s\n", "-");
+        }
+    }
 
-        write_blocks(1, NUM_INODE_BLOCKS, inodes);
-        write_blocks(1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
-        write_blocks(BITMAP_BLOCK_OFFSET, NUM_DATA_BLOCKS_FOR_BITMAP, free_blocks);
+    sfs_cache_stats_t cs;
+    sfs_get_cache_stats(&cs);
+    if (cs.hits + cs.misses + cs.blocks_flushed > 0) {
+        fprintf(out, "cache: %lu hits, %lu misses, %lu read ahead, %lu blocks flushed in %lu runs, %lu throttled writes\n",
+                cs.hits, cs.misses, cs.readahead, cs.blocks_flushed, cs.flushes, cs.throttled);
     }
+}
 
-    return inode;
+/** @brief Write everything out to the disk
+ * 
+ *  `sfs_sync()` writes the free counters to the superblock and 
+ *  back the dirty blocks of the buffer cache, then flushes the 
+ *  block device. Everything written before the call is on the 
+ *  disk once it returns. The superblock still reads as mounted, 
+ *  since the counters go stale again with the next change.
+ * 
+ *  @return 0 on success
+*/
+int sfs_sync() {
+    {
+        SFS_LOCK();
+        begin_op(SFS_OP_SYNC, 0);
+        write_super();
+    }
+    cache_sync();
+    return sfs_dev->flush(sfs_dev);
+}
+
+/** @brief Unmount the file system
+ * 
+ *  `sfs_unmount()` writes the free counters to the superblock and 
+ *  marks it clean, so that the next mount can trust them. It then 
+ *  dumps the I/O accounting report, stops the buffer cache, which 
+ *  writes back its dirty blocks, and flushes and closes the block 
+ *  device.
+ * 
+ *  @return void
+*/
+void sfs_unmount() {
+    SFS_LOCK();
+    begin_op(SFS_OP_SYNC, 0);
+    super.clean = 1;
+    write_super();
+    sfs_print_iostats(stdout);
+    cache_stop();
+    sfs_dev->flush(sfs_dev);
+    sfs_dev->close(sfs_dev);
 }
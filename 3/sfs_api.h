@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "blockdev.h"
 #include "disk_emu.h"
 
 /**  @brief MACROS
@@ -65,6 +66,17 @@
 
 #define MAX_FILENAME 60
 #define DISK_NAME "thematrixmaster.disk"
+#define SFS_MAGIC 0xACBD0006
+#define SFS_MAX_MAPS 32
+
+/*
+    Directory entry modes: an entry is free (0) or in use (1). An entry that
+    sfs_rename() is about to replace is marked DIR_REPLACED on the disk first,
+    so that mksfs() can tell after a crash whether the rename got committed.
+*/
+#define DIR_FREE 0
+#define DIR_IN_USE 1
+#define DIR_REPLACED 2
 
 #define BLOCK_SIZE 1024
 #define NUM_INODES 128
@@ -88,8 +100,11 @@
 
 
 /** @brief Data structure for Superblock
- * occupies 20 bytes and stores
- * metadata about the file system
+ * occupies 32 bytes and stores
+ * metadata about the file system,
+ * the number of free data blocks
+ * and i-nodes, and whether it was
+ * cleanly unmounted
 */
 typedef struct {
     unsigned int magic;
@@ -97,6 +112,9 @@ typedef struct {
     unsigned int fs_size;
     unsigned int inode_table_len;
     unsigned int root_dir_inode;
+    unsigned int free_block_cnt;
+    unsigned int free_inode_cnt;
+    unsigned int clean;
 } superblock_t;
 
 /** @struct i-node occupies 64 bytes and stores:
@@ -116,22 +134,45 @@ typedef struct {
 
 /** @struct directory table entry 
  * occupies 64 bytes and stores a duplicate
- * of the i-node mode field and a char array
- * for the filename
+ * of the i-node mode field (DIR_FREE, DIR_IN_USE
+ * or DIR_REPLACED) and a char array for the filename
 */
 typedef struct {
     unsigned int mode;
     char names[MAX_FILENAME];
 } directory_entry_t;
 
+/** @enum access pattern advice given 
+ * through sfs_fadvise(), after the 
+ * POSIX_FADV_* values of posix_fadvise
+*/
+typedef enum {
+    SFS_FADV_NORMAL,
+    SFS_FADV_SEQUENTIAL,
+    SFS_FADV_RANDOM,
+    SFS_FADV_WILLNEED,
+    SFS_FADV_DONTNEED,
+    SFS_FADV_NOREUSE
+} sfs_advice_t;
+
 /** @struct file descriptor
- * occupies 16 bytes and stores a ref
- * to the inode and the file's current
- * read-write address
+ * stores a ref to the inode, the file's 
+ * current read-write address and the 
+ * readahead state of the descriptor:
+ * advice: SFS_FADV_NORMAL, SEQUENTIAL or RANDOM
+ * noreuse: the data is accessed once, cache it last
+ * ra_window: blocks to read ahead of the reader
+ * ra_end: file block index readahead has reached
+ * last_end: address the last read stopped at
 */
 typedef struct {
     int inode;
     uint64_t rwptr;
+    int advice;
+    int noreuse;
+    int ra_window;
+    int ra_end;
+    uint64_t last_end;
 } file_descriptor_t;
 
 /** @struct bitmap entry 
@@ -140,14 +181,119 @@ typedef struct {
 */
 typedef unsigned char bitmap_entry_t;
 
-void mksfs(int fresh);
+/** @struct file system usage
+ * returned by sfs_statfs(), counts
+ * only data blocks and file i-nodes
+*/
+typedef struct {
+    unsigned int block_size;
+    unsigned int total_blocks;
+    unsigned int free_blocks;
+    unsigned int total_inodes;
+    unsigned int free_inodes;
+} sfs_statfs_t;
+
+/** @struct directory listing entry
+ * returned by sfs_readdir(), with the
+ * attributes of the file so that a listing
+ * needs no separate lookup per file
+*/
+typedef struct {
+    char name[MAX_FILENAME];
+    int inode;
+    unsigned int size;
+} sfs_dirent_t;
+
+/** @struct file mapping
+ * handed out by sfs_mmap(), with
+ * where its contents belong in the file
+ * and, if writable, a copy of them as
+ * last read or written back
+*/
+typedef struct {
+    void* addr;
+    void* synced;
+    int fileID;
+    int inode;
+    int offset;
+    int length;
+    int writable;
+} sfs_map_t;
+
+/** @enum operations that disk accesses 
+ * are charged to by the I/O accounting
+*/
+typedef enum {
+    SFS_OP_MKSFS,
+    SFS_OP_OPEN,
+    SFS_OP_WRITE,
+    SFS_OP_READ,
+    SFS_OP_REMOVE,
+    SFS_OP_RENAME,
+    SFS_OP_TRUNCATE,
+    SFS_OP_FADVISE,
+    SFS_OP_SYNC,
+    SFS_NUM_OPS
+} sfs_op_t;
+
+/** @enum kinds of blocks on the disk, 
+ * used to break down the I/O accounting
+*/
+typedef enum {
+    BLOCK_SUPER,
+    BLOCK_INODE,
+    BLOCK_DIR,
+    BLOCK_BITMAP,
+    BLOCK_INDIRECT,
+    BLOCK_DATA,
+    SFS_NUM_BLOCK_TYPES
+} sfs_block_type_t;
+
+/** @struct I/O counters of one operation
+ * calls: number of times it was called
+ * bytes_requested: logical bytes asked for by callers
+ * blocks_read / blocks_written: disk blocks per block type
+*/
+typedef struct {
+    unsigned long calls;
+    unsigned long bytes_requested;
+    unsigned long blocks_read[SFS_NUM_BLOCK_TYPES];
+    unsigned long blocks_written[SFS_NUM_BLOCK_TYPES];
+} sfs_op_stats_t;
+
+/** @struct I/O counters of every operation
+*/
+typedef struct {
+    sfs_op_stats_t ops[SFS_NUM_OPS];
+} sfs_iostats_t;
+
+void sfs_set_blockdev(blockdev_t* dev);
+int mksfs(int fresh);
 int sfs_getnextfilename(char* fname);
 int sfs_getfilesize(const char* path);
+int sfs_readdir(int* pos, sfs_dirent_t* entries, int max);
 int sfs_fopen(char* name);
 int sfs_fclose(int fileID);
 int sfs_fwrite(int fileID, const char* buf, int length);
 int sfs_fread(int fileID, char* buf, int length);
 int sfs_fseek(int fileID, int loc);
+int sfs_pread(int fileID, char* buf, int length, int loc);
+int sfs_pwrite(int fileID, const char* buf, int length, int loc);
+int sfs_ftruncate(int fileID, int length);
+int sfs_fadvise(int fileID, int offset, int length, int advice);
+int sfs_lookup(const char* name);
+int sfs_getinodesize(int inode);
+int sfs_fopen_inode(int inode);
+void* sfs_mmap(int fileID, int offset, int length, int writable);
+int sfs_msync(void* addr);
+int sfs_munmap(void* addr);
 int sfs_remove(char* file);
+int sfs_rename(char* oldname, char* newname);
+int sfs_statfs(sfs_statfs_t* st);
+void sfs_get_iostats(sfs_iostats_t* out);
+void sfs_reset_iostats();
+void sfs_print_iostats(FILE* out);
+int sfs_sync();
+void sfs_unmount();
 
 #endif
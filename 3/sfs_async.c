@@ -0,0 +1,99 @@
+/** @file sfs_async.c
+ *  @brief Asynchronous file system calls for SUT tasks
+ *
+ *  Every call packs its arguments into a request on the task's own
+ *  stack and hands a runner to `sut_io()`, which executes it on the
+ *  I/O executor. The task stays parked until the runner returns, so
+ *  the request outlives the call. Nothing runs in parallel here: the
+ *  I/O executor is a single thread, so the calls of all tasks reach
+ *  SFS one at a time and two tasks sharing a descriptor never
+ *  interleave inside a call.
+ *
+ *  @bug No known bugs.
+ */
+
+#include "sfs_async.h"
+
+/** @struct arguments and result
+ * of one asynchronous call
+*/
+typedef struct {
+    char* name;
+    int fileID;
+    char* buf;
+    const char* wbuf;
+    int length;
+    int result;
+} sfs_request_t;
+
+void* run_open(void* arg) {
+    sfs_request_t* r = (sfs_request_t*) arg;
+    r->result = sfs_fopen(r->name);
+    return NULL;
+}
+
+void* run_close(void* arg) {
+    sfs_request_t* r = (sfs_request_t*) arg;
+    r->result = sfs_fclose(r->fileID);
+    return NULL;
+}
+
+void* run_read(void* arg) {
+    sfs_request_t* r = (sfs_request_t*) arg;
+    r->result = sfs_fread(r->fileID, r->buf, r->length);
+    return NULL;
+}
+
+void* run_write(void* arg) {
+    sfs_request_t* r = (sfs_request_t*) arg;
+    r->result = sfs_fwrite(r->fileID, r->wbuf, r->length);
+    return NULL;
+}
+
+/** @brief Open a file from a SUT task
+ * 
+ *  @param name the name of the file to open
+ *  @return file descriptor of file on success and -1 on failure
+*/
+int sfs_aopen(char* name) {
+    sfs_request_t r = {.name = name};
+    sut_io(run_open, &r);
+    return r.result;
+}
+
+/** @brief Close a file from a SUT task
+ * 
+ *  @param fileID the file descriptor of the file to close
+ *  @return 0 on success and -1 on failure
+*/
+int sfs_aclose(int fileID) {
+    sfs_request_t r = {.fileID = fileID};
+    sut_io(run_close, &r);
+    return r.result;
+}
+
+/** @brief Read from a file from a SUT task
+ * 
+ *  @param fileID file descriptor of the file to read from
+ *  @param buf char buffer to read data into
+ *  @param length amount of data to read in bytes
+ *  @return the actual of data read in bytes
+*/
+int sfs_aread(int fileID, char* buf, int length) {
+    sfs_request_t r = {.fileID = fileID, .buf = buf, .length = length};
+    sut_io(run_read, &r);
+    return r.result;
+}
+
+/** @brief Write to a file from a SUT task
+ * 
+ *  @param fileID the file descriptor of the file to write to
+ *  @param buf the buffer that holds the content we wish to write to disk
+ *  @param length the amount of bytes in the buffer to write to disk
+ *  @return the number of bytes written to disk
+*/
+int sfs_awrite(int fileID, const char* buf, int length) {
+    sfs_request_t r = {.fileID = fileID, .wbuf = buf, .length = length};
+    sut_io(run_write, &r);
+    return r.result;
+}
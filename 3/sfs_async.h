@@ -0,0 +1,30 @@
+/** @file sfs_async.h
+ *  @brief Asynchronous file system calls for SUT tasks
+ *
+ *  Each call parks the calling SUT task, runs the matching sfs_api
+ *  call (and the disk_emu I/O behind it) on SUT's I/O executor, and
+ *  resumes the task with the result once it is done. The compute
+ *  executor keeps running other tasks in the meantime, so many tasks
+ *  can drive one file system without a kernel thread each. These may
+ *  only be called from inside a SUT task, after sut_init() and mksfs().
+ *
+ *  The I/O executor is a single thread that runs the calls one at a
+ *  time, in the order they were made: disk latency overlaps with the
+ *  compute tasks, never with another file system call, and a slow
+ *  call holds up every call queued behind it.
+ *
+ *  @bug No known bugs.
+ */
+
+#ifndef SFS_ASYNC_H
+#define SFS_ASYNC_H
+
+#include "sfs_api.h"
+#include "sut.h"
+
+int sfs_aopen(char* name);
+int sfs_aclose(int fileID);
+int sfs_aread(int fileID, char* buf, int length);
+int sfs_awrite(int fileID, const char* buf, int length);
+
+#endif
@@ -0,0 +1,402 @@
+/** @file sfs_bench.c
+ *  @brief Workload generator and benchmark for the file system
+ *
+ *  Where the sfs_test programs check correctness, sfs_bench measures
+ *  performance. It runs one configurable workload against a fresh
+ *  file system on an emulated disk with a chosen disk_emu profile, and
+ *  reports MB/s, ops/s and latency percentiles for every kind of
+ *  operation, followed by the simulated disk time and the SFS I/O
+ *  accounting report.
+ *
+ *  Workloads:
+ *    seqwrite   sequential writes, wrapping around at the end of each file
+ *    seqread    sequential reads of prefilled files
+ *    randwrite  block-aligned writes at random offsets of prefilled files
+ *    randread   block-aligned reads at random offsets of prefilled files
+ *    mixed      random reads and writes, -m percent of them reads
+ *    append     append streams, files are recreated once full
+ *    smallfile  rounds of create + write, stat and delete of small files
+ *
+ *  usage: sfs_bench [-w workload] [-b block_size] [-f files] [-z file_size]
+ *                   [-n ops] [-t threads] [-m read_pct] [-L block_usec]
+ *                   [-S seek_usec] [-D] [-Q queue_blocks] [-C cache_image:slots]
+ *                   [-B buffer_blocks] [-E emu|pread|mmap|ram] [-H] [-A advice]
+ *                   [-r stripe|mirror:images] [-k chunk]
+ *
+ *  @bug No known bugs.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_cache.h"
+
+#define MAX_BENCH_THREADS 32
+#define MAX_FILE_SIZE ((int) ((MAX_DATA_BLOCKS_PER_FILE - 1) * BLOCK_SIZE))
+
+/** @enum kinds of operations timed by the benchmark
+*/
+typedef enum {
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_CREATE,
+    BENCH_STAT,
+    BENCH_DELETE,
+    BENCH_NUM_OPS
+} bench_op_t;
+
+const char* bench_op_names[BENCH_NUM_OPS] = {"read", "write", "create", "stat", "delete"};
+
+/** @struct latencies of one kind of operation
+*/
+typedef struct {
+    unsigned long count;
+    unsigned long capacity;
+    unsigned long bytes;
+    double* usec;
+} bench_stats_t;
+
+/** @struct state of one benchmark thread
+*/
+typedef struct {
+    int id;
+    unsigned int seed;
+    bench_stats_t ops[BENCH_NUM_OPS];
+} bench_thread_t;
+
+/*
+ *  Benchmark parameters, set from the command line
+*/
+char* workload = "seqwrite";
+int block_size = 4096;
+int bench_files = 4;
+int file_size = 200 * 1024;
+int num_ops = 1000;
+int num_threads = 1;
+int read_pct = 70;
+int advice = -1;
+
+const char* advice_names[] = {"normal", "sequential", "random", "willneed", "dontneed", "noreuse"};
+
+double now_usec() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+void record(bench_stats_t* st, int bytes, double usec) {
+    if (st->count == st->capacity) {
+        st->capacity = st->capacity ? st->capacity * 2 : 1024;
+        st->usec = (double*) realloc(st->usec, st->capacity * sizeof(double));
+    }
+    st->usec[st->count++] = usec;
+    st->bytes += bytes;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Helper function for naming benchmark files
+ *
+ *  @param name buffer of at least MAX_FILENAME bytes
+ *  @param thread the thread owning the file
+ *  @param index the index of the file for that thread
+ *  @return void
+*/
+void file_name(char* name, int thread, int index) {
+    snprintf(name, MAX_FILENAME, "bench_%d_%d", thread, index);
+}
+
+/** @brief Helper function for the number of files a thread owns
+*/
+int files_per_thread() {
+    int n = bench_files / num_threads;
+    return n > 0 ? n : 1;
+}
+
+/** @brief Timed positional read or write on an open file
+ *
+ *  @return the number of bytes transferred
+*/
+int timed_io(bench_thread_t* t, bench_op_t op, int fd, int offset, char* buf) {
+    double start = now_usec();
+    int n;
+
+    // every thread owns its files, so calls on one file never overlap
+    if (op == BENCH_READ) n = sfs_pread(fd, buf, block_size, offset);
+    else n = sfs_pwrite(fd, buf, block_size, offset);
+
+    record(&t->ops[op], n, now_usec() - start);
+    return n;
+}
+
+/** @brief Creates and fills every file of every thread
+ *
+ *  Runs before the clock starts for the workloads that need data.
+*/
+void prefill() {
+    char name[MAX_FILENAME];
+    char* buf = (char*) malloc(file_size);
+    memset(buf, 'p', file_size);
+
+    for (int t=0; t<num_threads; t++) {
+        for (int i=0; i<files_per_thread(); i++) {
+            file_name(name, t, i);
+            int fd = sfs_fopen(name);
+            sfs_fwrite(fd, buf, file_size);
+            sfs_fclose(fd);
+        }
+    }
+    free(buf);
+}
+
+/** @brief Body of one benchmark thread
+*/
+void* run_thread(void* arg) {
+    bench_thread_t* t = (bench_thread_t*) arg;
+    char name[MAX_FILENAME];
+    char* buf = (char*) malloc(block_size);
+    int nfiles = files_per_thread();
+    int fds[nfiles];
+    int offsets[nfiles];
+    int blocks_per_file = file_size / block_size;
+
+    memset(buf, 'a' + t->id % 26, block_size);
+
+    if (strcmp(workload, "smallfile") == 0) {
+        for (int done=0; done<num_ops; done+=nfiles) {
+            for (int i=0; i<nfiles; i++) {
+                file_name(name, t->id, i);
+                double start = now_usec();
+                int fd = sfs_fopen(name);
+                sfs_fwrite(fd, buf, block_size);
+                sfs_fclose(fd);
+                record(&t->ops[BENCH_CREATE], block_size, now_usec() - start);
+            }
+            for (int i=0; i<nfiles; i++) {
+                file_name(name, t->id, i);
+                double start = now_usec();
+                sfs_getfilesize(name);
+                record(&t->ops[BENCH_STAT], 0, now_usec() - start);
+            }
+            for (int i=0; i<nfiles; i++) {
+                file_name(name, t->id, i);
+                double start = now_usec();
+                sfs_remove(name);
+                record(&t->ops[BENCH_DELETE], 0, now_usec() - start);
+            }
+        }
+        free(buf);
+        return NULL;
+    }
+
+    for (int i=0; i<nfiles; i++) {
+        file_name(name, t->id, i);
+        fds[i] = sfs_fopen(name);
+        offsets[i] = 0;
+        if (advice != -1) sfs_fadvise(fds[i], 0, 0, advice);
+    }
+
+    for (int op=0; op<num_ops; op++) {
+        int i = op % nfiles;
+        int random_offset = (rand_r(&t->seed) % blocks_per_file) * block_size;
+
+        if (strcmp(workload, "seqwrite") == 0 || strcmp(workload, "seqread") == 0) {
+            bench_op_t kind = workload[3] == 'w' ? BENCH_WRITE : BENCH_READ;
+            if (offsets[i] + block_size > file_size) offsets[i] = 0;
+            timed_io(t, kind, fds[i], offsets[i], buf);
+            offsets[i] += block_size;
+        } else if (strcmp(workload, "randwrite") == 0) {
+            timed_io(t, BENCH_WRITE, fds[i], random_offset, buf);
+        } else if (strcmp(workload, "randread") == 0) {
+            timed_io(t, BENCH_READ, fds[i], random_offset, buf);
+        } else if (strcmp(workload, "mixed") == 0) {
+            bench_op_t kind = (rand_r(&t->seed) % 100) < read_pct ? BENCH_READ : BENCH_WRITE;
+            timed_io(t, kind, fds[i], random_offset, buf);
+        } else if (strcmp(workload, "append") == 0) {
+            if (offsets[i] + block_size > file_size) {
+                // file is full: start a new stream in its place
+                file_name(name, t->id, i);
+                sfs_remove(name);
+                fds[i] = sfs_fopen(name);
+                offsets[i] = 0;
+            }
+            timed_io(t, BENCH_WRITE, fds[i], offsets[i], buf);
+            offsets[i] += block_size;
+        }
+    }
+
+    for (int i=0; i<nfiles; i++) sfs_fclose(fds[i]);
+
+    free(buf);
+    return NULL;
+}
+
+/** @brief Prints one line of results, merging every thread
+*/
+void report(bench_thread_t* threads, bench_op_t op, double elapsed) {
+    bench_stats_t all = {0};
+
+    for (int t=0; t<num_threads; t++) {
+        bench_stats_t* st = &threads[t].ops[op];
+        for (unsigned long i=0; i<st->count; i++) record(&all, 0, st->usec[i]);
+        all.bytes += st->bytes;
+    }
+    if (all.count == 0) return;
+
+    qsort(all.usec, all.count, sizeof(double), compare_doubles);
+    printf(
+        "%-7s %9lu %9.2f %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+        bench_op_names[op],
+        all.count,
+        all.bytes / elapsed,    // bytes per usec == MB/s
+        all.count / (elapsed / 1e6),
+        all.usec[all.count / 2],
+        all.usec[(all.count * 90) / 100],
+        all.usec[(all.count * 99) / 100],
+        all.usec[all.count - 1]
+    );
+    free(all.usec);
+}
+
+void usage() {
+    printf("usage: sfs_bench [-w workload] [-b block_size] [-f files] [-z file_size]\n");
+    printf("                 [-n ops] [-t threads] [-m read_pct] [-L block_usec]\n");
+    printf("                 [-S seek_usec] [-D] [-Q queue_blocks] [-C cache_image:slots]\n");
+    printf("                 [-B buffer_blocks] [-E emu|pread|mmap|ram] [-H] [-A advice]\n");
+    printf("                 [-r stripe|mirror:images] [-k chunk]\n");
+    printf("  -H  back a RAM disk with huge pages\n");
+    printf("  -r  stripe chunks of -k blocks over, or mirror the emulated disk on, that many images\n");
+    printf("  -A  sfs_fadvise the benchmark files: normal sequential random willneed dontneed noreuse\n");
+    printf("workloads: seqwrite seqread randwrite randread mixed append smallfile\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    double block_usec = 0;
+    double seek_usec = 0;
+    int array_mode = DISK_SINGLE;
+    int array_images = 0;
+    int chunk = 1;
+
+    while ((opt = getopt(argc, argv, "w:b:f:z:n:t:m:L:S:DQ:C:B:E:HA:r:k:")) != -1) {
+        switch (opt) {
+            case 'w': workload = optarg; break;
+            case 'b': block_size = atoi(optarg); break;
+            case 'f': bench_files = atoi(optarg); break;
+            case 'z': file_size = atoi(optarg); break;
+            case 'n': num_ops = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'm': read_pct = atoi(optarg); break;
+            case 'L': block_usec = atof(optarg); break;
+            case 'S': seek_usec = atof(optarg); break;
+            case 'D': set_disk_direct_io(1); break;
+            case 'Q': set_disk_write_queue(atoi(optarg), 100); break;
+            case 'B': sfs_set_cache(atoi(optarg), 0, 0, 0); break;
+            case 'H': blockdev_ram_hugepages(1); break;
+            case 'A': {
+                for (int a=SFS_FADV_NORMAL; a<=SFS_FADV_NOREUSE; a++) {
+                    if (strcmp(optarg, advice_names[a]) == 0) advice = a;
+                }
+                if (advice == -1) { usage(); return 1; }
+                break;
+            }
+            case 'E': {
+                blockdev_t* dev = blockdev_by_name(optarg);
+                if (dev == NULL) { usage(); return 1; }
+                sfs_set_blockdev(dev);
+                break;
+            }
+            case 'C': {
+                char* colon = strchr(optarg, ':');
+                if (colon == NULL) { usage(); return 1; }
+                *colon = '\0';
+                set_disk_cache(optarg, atoi(colon + 1));
+                break;
+            }
+            case 'r': {
+                char* colon = strchr(optarg, ':');
+                if (colon == NULL) { usage(); return 1; }
+                *colon = '\0';
+                if (strcmp(optarg, "stripe") == 0) array_mode = DISK_STRIPED;
+                else if (strcmp(optarg, "mirror") == 0) array_mode = DISK_MIRRORED;
+                else { usage(); return 1; }
+                array_images = atoi(colon + 1);
+                break;
+            }
+            case 'k': chunk = atoi(optarg); break;
+            default: usage(); return 1;
+        }
+    }
+
+    if (
+        block_size <= 0 || file_size < block_size || file_size > MAX_FILE_SIZE ||
+        num_threads <= 0 || num_threads > MAX_BENCH_THREADS ||
+        num_threads * files_per_thread() > NUM_FILE_INODES
+    ) {
+        printf("Invalid parameters: files hold at most %d bytes, at most %d files and %d threads\n",
+               MAX_FILE_SIZE, NUM_FILE_INODES, MAX_BENCH_THREADS);
+        usage();
+        return 1;
+    }
+
+    // the images of an array are named after the disk: DISK_NAME.0, DISK_NAME.1, ...
+    char array_names[MAX_DISK_IMAGES][sizeof(DISK_NAME) + 4];
+    char* array_files[MAX_DISK_IMAGES];
+    if (array_mode != DISK_SINGLE) {
+        for (int i=0; i<array_images && i<MAX_DISK_IMAGES; i++) {
+            snprintf(array_names[i], sizeof(array_names[i]), "%s.%d", DISK_NAME, i);
+            array_files[i] = array_names[i];
+        }
+        if (set_disk_array(array_mode, chunk, array_images, array_files) == -1) return 1;
+    }
+
+    if (mksfs(1) == -1) return 1;
+    set_disk_latency(block_usec, seek_usec);
+
+    if (strcmp(workload, "seqwrite") != 0 && strcmp(workload, "append") != 0 && strcmp(workload, "smallfile") != 0) {
+        prefill();
+    }
+    sfs_sync();
+    sfs_reset_iostats();
+
+    disk_stats_t before, after;
+    get_disk_stats(&before);
+
+    bench_thread_t threads[num_threads];
+    pthread_t ids[num_threads];
+    memset(threads, 0, sizeof(threads));
+
+    double start = now_usec();
+    for (int t=0; t<num_threads; t++) {
+        threads[t].id = t;
+        threads[t].seed = 1234 + t;
+        pthread_create(&ids[t], NULL, run_thread, &threads[t]);
+    }
+    for (int t=0; t<num_threads; t++) pthread_join(ids[t], NULL);
+
+    sfs_sync();
+    double elapsed = now_usec() - start;
+    get_disk_stats(&after);
+
+    printf("workload %s: bs=%d files=%d file_size=%d ops=%d threads=%d\n",
+           workload, block_size, num_threads * files_per_thread(), file_size, num_ops, num_threads);
+    printf("elapsed %.3f s, simulated disk time %.3f s\n",
+           elapsed / 1e6, (after.busy_usec - before.busy_usec) / 1e6);
+    printf("%-7s %9s %9s %10s %9s %9s %9s %9s\n",
+           "op", "count", "MB/s", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+    for (int op=0; op<BENCH_NUM_OPS; op++) report(threads, op, elapsed);
+
+    printf("\n");
+    sfs_unmount();
+
+    for (int t=0; t<num_threads; t++) {
+        for (int op=0; op<BENCH_NUM_OPS; op++) free(threads[t].ops[op].usec);
+    }
+    return 0;
+}
@@ -0,0 +1,721 @@
+/** @file sfs_cache.c
+ *  @brief Write-back buffer cache between SFS and the disk
+ *
+ *  The cache holds a fixed number of block-sized slots. cache_slot_of
+ *  maps every block of the disk to the slot holding it. Clean slots are
+ *  kept on an LRU list and dirty ones on a list in the order they were
+ *  dirtied, so neither eviction nor the flusher scans the cache. A slot
+ *  is evicted in least recently used order once it is clean. Writes only
+ *  dirty their slots; the flusher thread owns all write-back. It copies
+ *  the dirty blocks it picked, sorted by address, into one buffer and
+ *  submits each run of adjacent blocks to the device as a single write,
+ *  with the cache lock dropped so that readers and writers keep going.
+ *  Until that write is done the slots are marked writeback and can not
+ *  be evicted, so a read never sees the older contents of the disk.
+ *
+ *  @bug Dirty blocks that have not been flushed are lost on a crash.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "sfs_cache.h"
+
+/** @struct a list of slots, linked through their prev and next
+*/
+typedef struct {
+    int head;
+    int tail;
+} cache_list_t;
+
+/** @struct one slot of the cache
+ * block: the disk block it holds, or -1
+ * dirty: newer than the disk
+ * writeback: being written by the flusher
+ * cold: not expected to be used again, evicted first
+ * dirtied: when it became dirty, in ms
+ * list: the list the slot is on, NULL while it is written back
+ * prev / next: its neighbours on that list, or -1
+*/
+typedef struct {
+    int block;
+    int dirty;
+    int writeback;
+    int cold;
+    double dirtied;
+    cache_list_t* list;
+    int prev;
+    int next;
+} cache_slot_t;
+
+/*
+ *  Tunables set by sfs_set_cache(), the cache is off while
+ *  cache_nslots is 0 and every call goes straight to the disk
+*/
+int cache_nslots = 0;
+int cache_expire_ms = 5000;
+int cache_background_pct = 10;
+int cache_hard_pct = 40;
+
+/*
+ *  Cache state, all of it guarded by cache_lock. The flusher
+ *  sleeps on cache_flush_cond, throttled writers and callers
+ *  waiting for a flush to finish sleep on cache_room_cond.
+ *  cache_gen counts the writes and discards of every block, so
+ *  that a read done without the lock can tell it went stale.
+*/
+cache_slot_t* cache_slots = NULL;
+char* cache_data = NULL;
+char* cache_flush_buf = NULL;
+int* cache_flush_order = NULL;
+int* cache_flush_addr = NULL;
+blockdev_request_t* cache_flush_reqs = NULL;
+int cache_slot_of[NUM_TOTAL_BLOCKS];
+unsigned int cache_gen[NUM_TOTAL_BLOCKS];
+int cache_dirty_count = 0;
+int cache_background_limit = 0;
+int cache_hard_limit = 0;
+int cache_flushing = 0;
+int cache_flush_wanted = 0;
+int cache_running = 0;
+sfs_cache_stats_t cache_stats;
+
+blockdev_t* cache_dev = NULL;
+pthread_t cache_flusher;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_flush_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cache_room_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ *  Every slot is on one of these lists, except while the flusher
+ *  writes it back: cache_free holds the empty slots, cache_lru the
+ *  clean ones from least to most recently used, and cache_dirty the
+ *  dirty ones in the order they became dirty
+*/
+cache_list_t cache_free;
+cache_list_t cache_lru;
+cache_list_t cache_dirty;
+
+/** @brief Configure the buffer cache
+ *
+ *  Must be called before mksfs(). Dirty blocks are written back once
+ *  they are expire_ms old, or all at once when more than background_pct
+ *  percent of the cache is dirty. Writers block only while more than
+ *  hard_pct percent is dirty. Passing 0 blocks disables the cache.
+ *
+ *  @param nblocks number of blocks the cache holds
+ *  @param expire_ms age at which a dirty block is written back
+ *  @param background_pct dirty ratio that wakes the flusher
+ *  @param hard_pct dirty ratio at which writers wait for the flusher
+ *  @return void
+*/
+void sfs_set_cache(int nblocks, int expire_ms, int background_pct, int hard_pct) {
+    cache_nslots = nblocks > 0 ? nblocks : 0;
+    if (expire_ms > 0) cache_expire_ms = expire_ms;
+    if (background_pct > 0) cache_background_pct = background_pct;
+    if (hard_pct > 0) cache_hard_pct = hard_pct;
+}
+
+/** @brief Get the buffer cache counters
+ *
+ *  @param out where to copy the counters
+ *  @return void
+*/
+void sfs_get_cache_stats(sfs_cache_stats_t* out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = cache_stats;
+    out->dirty = cache_dirty_count;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** @brief Helper function for timestamps
+ *
+ *  @return the monotonic clock in milliseconds
+*/
+double cache_now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/** @brief Helper function for the contents of a slot
+ *
+ *  @param slot index of the slot
+ *  @return pointer to its block of data
+*/
+char* slot_data(int slot) {
+    return cache_data + (size_t) slot * BLOCK_SIZE;
+}
+
+/** @brief Helper function for taking a slot off its list
+ *
+ *  @param slot index of the slot
+ *  @return void
+*/
+void cache_list_unlink(int slot) {
+    cache_slot_t* s = &cache_slots[slot];
+    cache_list_t* l = s->list;
+    if (l == NULL) return;
+
+    if (s->prev != -1) cache_slots[s->prev].next = s->next;
+    else l->head = s->next;
+    if (s->next != -1) cache_slots[s->next].prev = s->prev;
+    else l->tail = s->prev;
+
+    s->list = NULL;
+    s->prev = -1;
+    s->next = -1;
+}
+
+/** @brief Helper function for moving a slot onto a list
+ *
+ *  @param l the list
+ *  @param slot index of the slot
+ *  @param front put it at the head of the list instead of the tail
+ *  @return void
+*/
+void cache_list_push(cache_list_t* l, int slot, int front) {
+    cache_slot_t* s = &cache_slots[slot];
+    cache_list_unlink(slot);
+    s->list = l;
+
+    if (front) {
+        s->next = l->head;
+        if (l->head != -1) cache_slots[l->head].prev = slot;
+        else l->tail = slot;
+        l->head = slot;
+    } else {
+        s->prev = l->tail;
+        if (l->tail != -1) cache_slots[l->tail].next = slot;
+        else l->head = slot;
+        l->tail = slot;
+    }
+}
+
+/** @brief Helper function for filing a slot on the right list
+ *
+ *  A dirty slot joins the end of the dirty list unless it is on it
+ *  already. A clean one goes to the most recently used end of the
+ *  LRU list, or to the least recently used end if it is cold.
+ *
+ *  @param slot index of a slot that is not being written back
+ *  @return void
+*/
+void cache_settle(int slot) {
+    cache_slot_t* s = &cache_slots[slot];
+    if (!s->dirty) cache_list_push(&cache_lru, slot, s->cold);
+    else if (s->list != &cache_dirty) cache_list_push(&cache_dirty, slot, 0);
+}
+
+/** @brief Helper function for emptying a slot
+ *
+ *  @param slot index of a slot that is not being written back
+ *  @return void
+*/
+void cache_evict(int slot) {
+    cache_slot_t* s = &cache_slots[slot];
+    if (s->dirty) cache_dirty_count -= 1;
+
+    cache_slot_of[s->block] = -1;
+    s->block = -1;
+    s->dirty = 0;
+    cache_list_push(&cache_free, slot, 0);
+}
+
+/** @brief Helper function for finding a slot for a block
+ *
+ *  cache_get_slot() takes an empty slot if there is one, otherwise
+ *  the least recently used clean one, and assigns it to the block.
+ *  The slot is on no list until the caller has filled it and passed
+ *  it to cache_touch().
+ *
+ *  @param block the disk block the slot will hold
+ *  @return index of the slot or -1 if every slot is dirty
+*/
+int cache_get_slot(int block) {
+    int slot = cache_free.head != -1 ? cache_free.head : cache_lru.head;
+    if (slot == -1) return -1;
+
+    cache_slot_t* s = &cache_slots[slot];
+    cache_list_unlink(slot);
+    if (s->block != -1) cache_slot_of[s->block] = -1;
+    s->block = block;
+    s->dirty = 0;
+    s->cold = 0;
+    cache_slot_of[block] = slot;
+    return slot;
+}
+
+int compare_flush_order(const void* a, const void* b) {
+    return cache_slots[*(const int*) a].block - cache_slots[*(const int*) b].block;
+}
+
+/** @brief Helper function for writing dirty blocks back
+ *
+ *  Writes back every dirty block if all is set, the flusher was
+ *  asked for room or the dirty ratio is over the background limit,
+ *  and only the expired ones otherwise. Only one flush runs at a
+ *  time so that two copies of a block can never race to the disk.
+ *  Must be called with cache_lock held; it is dropped during the
+ *  writes.
+ *
+ *  @param all write back every dirty block
+ *  @return void
+*/
+void cache_flush_dirty(int all) {
+    while (cache_flushing) pthread_cond_wait(&cache_room_cond, &cache_lock);
+    cache_flushing = 1;
+
+    double now = cache_now_ms();
+    if (cache_flush_wanted || cache_dirty_count > cache_background_limit) all = 1;
+    cache_flush_wanted = 0;
+
+    // the dirty list is in dirtying order, so the expired blocks come first
+    int n = 0;
+    for (int i=cache_dirty.head; i != -1; i=cache_slots[i].next) {
+        if (!all && now - cache_slots[i].dirtied < cache_expire_ms) break;
+        cache_flush_order[n++] = i;
+    }
+
+    if (n > 0) {
+        qsort(cache_flush_order, n, sizeof(int), compare_flush_order);
+
+        int* addr = cache_flush_addr;
+        for (int k=0; k<n; k++) {
+            cache_slot_t* s = &cache_slots[cache_flush_order[k]];
+            memcpy(cache_flush_buf + (size_t) k * BLOCK_SIZE, slot_data(cache_flush_order[k]), BLOCK_SIZE);
+            addr[k] = s->block;
+            s->dirty = 0;
+            s->writeback = 1;
+            cache_list_unlink(cache_flush_order[k]);
+        }
+        cache_dirty_count -= n;
+
+        blockdev_request_t* reqs = cache_flush_reqs;
+        int nreqs = 0;
+        for (int k=0, run; k<n; k+=run) {
+            for (run=1; k+run < n && addr[k+run] == addr[k] + run; run++);
+            reqs[nreqs++] = (blockdev_request_t) {
+                .op = BLOCKDEV_WRITE,
+                .start_address = addr[k],
+                .nblocks = run,
+                .buffer = cache_flush_buf + (size_t) k * BLOCK_SIZE,
+            };
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+        cache_dev->submit(cache_dev, reqs, nreqs);
+        while (cache_dev->poll(cache_dev) > 0);
+        pthread_mutex_lock(&cache_lock);
+
+        for (int k=0; k<n; k++) {
+            cache_slots[cache_flush_order[k]].writeback = 0;
+            cache_settle(cache_flush_order[k]);
+        }
+        cache_stats.flushes += 1;
+        cache_stats.blocks_flushed += n;
+    }
+
+    cache_flushing = 0;
+    pthread_cond_broadcast(&cache_room_cond);
+}
+
+/** @brief The flusher thread
+ *
+ *  Wakes up every half expiry period to write back the expired
+ *  blocks, and right away when a writer pushes the dirty ratio over
+ *  the background limit or runs out of clean slots.
+ *
+ *  @return NULL
+*/
+void* cache_flush_loop(void* arg) {
+    struct timespec deadline;
+    long interval_ms = cache_expire_ms / 2 > 0 ? cache_expire_ms / 2 : 1;
+
+    pthread_mutex_lock(&cache_lock);
+    while (cache_running) {
+        if (!cache_flush_wanted && cache_dirty_count <= cache_background_limit) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += interval_ms * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&cache_flush_cond, &cache_lock, &deadline);
+        }
+        if (!cache_running) break;
+
+        cache_flush_dirty(0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+/** @brief Start the buffer cache
+ *
+ *  Allocates the slots and starts the flusher thread. Called by
+ *  mksfs() once the device is open; if the cache is off, every
+ *  call just goes to the device.
+ *
+ *  @param dev the device the file system is mounted on
+ *  @return 0 on success and -1 on failure
+*/
+int cache_start(blockdev_t* dev) {
+    cache_dev = dev;
+    if (cache_nslots == 0) return 0;
+
+    cache_slots = (cache_slot_t*) malloc(cache_nslots * sizeof(cache_slot_t));
+    cache_data = (char*) malloc((size_t) cache_nslots * BLOCK_SIZE);
+    cache_flush_buf = (char*) malloc((size_t) cache_nslots * BLOCK_SIZE);
+    cache_flush_order = (int*) malloc(cache_nslots * sizeof(int));
+    cache_flush_addr = (int*) malloc(cache_nslots * sizeof(int));
+    cache_flush_reqs = (blockdev_request_t*) malloc(cache_nslots * sizeof(blockdev_request_t));
+    if (!cache_slots || !cache_data || !cache_flush_buf || !cache_flush_order || !cache_flush_addr || !cache_flush_reqs) {
+        printf("Could not allocate a buffer cache of %d blocks\n", cache_nslots);
+        cache_stop();
+        return -1;
+    }
+
+    cache_free = cache_lru = cache_dirty = (cache_list_t) {-1, -1};
+    for (int i=0; i<cache_nslots; i++) {
+        cache_slots[i] = (cache_slot_t) {.block = -1, .list = NULL, .prev = -1, .next = -1};
+        cache_list_push(&cache_free, i, 0);
+    }
+    for (int i=0; i<NUM_TOTAL_BLOCKS; i++) cache_slot_of[i] = -1;
+
+    cache_dirty_count = 0;
+    cache_background_limit = cache_nslots * cache_background_pct / 100;
+    cache_hard_limit = cache_nslots * cache_hard_pct / 100;
+    if (cache_hard_limit < 1) cache_hard_limit = 1;
+    memset(&cache_stats, 0, sizeof(cache_stats));
+
+    cache_running = 1;
+    pthread_create(&cache_flusher, NULL, cache_flush_loop, NULL);
+    return 0;
+}
+
+/** @brief Stop the buffer cache
+ *
+ *  Stops the flusher, writes back whatever is still dirty and
+ *  frees the slots. Does nothing if the cache was not started.
+ *
+ *  @return void
+*/
+void cache_stop() {
+    if (cache_running) {
+        pthread_mutex_lock(&cache_lock);
+        cache_running = 0;
+        pthread_cond_signal(&cache_flush_cond);
+        pthread_mutex_unlock(&cache_lock);
+        pthread_join(cache_flusher, NULL);
+
+        cache_sync();
+    }
+
+    free(cache_slots);
+    free(cache_data);
+    free(cache_flush_buf);
+    free(cache_flush_order);
+    free(cache_flush_addr);
+    free(cache_flush_reqs);
+    cache_slots = NULL;
+    cache_data = NULL;
+    cache_flush_buf = NULL;
+    cache_flush_order = NULL;
+    cache_flush_addr = NULL;
+    cache_flush_reqs = NULL;
+}
+
+/** @brief Write back every dirty block
+ *
+ *  @return void
+*/
+void cache_sync() {
+    if (cache_slots == NULL) return;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_flush_dirty(1);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** @brief Drop blocks from the cache
+ *
+ *  Called when the blocks are freed and discarded on the device, so
+ *  that they are neither written back nor served from memory again.
+ *  A block the flusher is writing right now is dropped once the
+ *  write is done, so that the write cannot land after the discard.
+ *
+ *  @return void
+*/
+void cache_discard(int start_address, int nblocks) {
+    if (cache_slots == NULL) return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int block=start_address; block<start_address + nblocks; block++) {
+        int slot;
+        while ((slot = cache_slot_of[block]) != -1 && cache_slots[slot].writeback)
+            pthread_cond_wait(&cache_room_cond, &cache_lock);
+
+        cache_gen[block] += 1;
+        if (slot != -1) cache_evict(slot);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** @brief Helper function for marking a slot as used
+ *
+ *  A CACHE_NOREUSE block is inserted as the least recently used one
+ *  and is not moved up by later accesses, so a one-pass scan only
+ *  ever recycles its own slots.
+ *
+ *  @param slot the slot that was accessed
+ *  @param inserted whether the block was just put in the slot
+ *  @param priority CACHE_NORMAL or CACHE_NOREUSE
+ *  @return void
+*/
+void cache_touch(int slot, int inserted, int priority) {
+    cache_slot_t* s = &cache_slots[slot];
+    if (priority == CACHE_NORMAL) s->cold = 0;
+    else if (inserted) s->cold = 1;
+
+    if (s->writeback) return;
+    if (s->dirty || s->list != &cache_lru) cache_settle(slot);
+    else if (priority == CACHE_NORMAL) cache_list_push(&cache_lru, slot, 0);
+}
+
+/** @brief Helper function for looking up blocks in the cache
+ *
+ *  cache_lookup() copies the cached blocks that are still marked
+ *  missing into the buffer and notes the generation of the others,
+ *  so that cache_fill() can tell whether they changed meanwhile.
+ *  Must be called with cache_lock held.
+ *
+ *  @param buf where to copy the cached blocks, NULL to only look
+ *  @return number of blocks that are still missing
+*/
+int cache_lookup(int start_address, int nblocks, char* missing, unsigned int* gen, char* buf, int priority) {
+    int misses = 0;
+
+    for (int i=0; i<nblocks; i++) {
+        if (!missing[i]) continue;
+
+        int slot = cache_slot_of[start_address + i];
+        if (slot == -1 || buf == NULL) {
+            missing[i] = (slot == -1);
+            gen[i] = cache_gen[start_address + i];
+            misses += missing[i];
+            continue;
+        }
+        memcpy(buf + (size_t) i * BLOCK_SIZE, slot_data(slot), BLOCK_SIZE);
+        cache_touch(slot, 0, priority);
+        missing[i] = 0;
+    }
+    return misses;
+}
+
+/** @brief Helper function for reading missing blocks into the cache
+ *
+ *  cache_fill() reads each run of missing blocks straight into the
+ *  buffer without holding the lock and caches them. A block that
+ *  was cached while we were reading it is taken from the cache
+ *  instead, since it may have been written and be newer than the
+ *  disk. A block that was written or discarded and left the cache
+ *  again is neither cached nor cleared in missing, since what we
+ *  read may predate the write; the caller has to read it again.
+ *
+ *  @param missing which of the nblocks blocks are to be read
+ *  @param gen the generation of each missing block before the read
+ *  @param inserted set to the number of blocks that were cached
+ *  @return number of blocks to read again or -1 on failure
+*/
+int cache_fill(int start_address, int nblocks, char* missing, const unsigned int* gen, char* buf, int priority, int* inserted) {
+    int stale = 0;
+
+    for (int i=0, run; i<nblocks; i+=run) {
+        for (run=1; i+run < nblocks && missing[i+run] == missing[i]; run++);
+        if (!missing[i]) continue;
+        if (cache_dev->read(cache_dev, start_address + i, run, buf + (size_t) i * BLOCK_SIZE) < 0) return -1;
+    }
+
+    *inserted = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int i=0; i<nblocks; i++) {
+        if (!missing[i]) continue;
+
+        int block = start_address + i;
+        int slot = cache_slot_of[block];
+        if (slot != -1) {
+            memcpy(buf + (size_t) i * BLOCK_SIZE, slot_data(slot), BLOCK_SIZE);
+            cache_touch(slot, 0, priority);
+        } else if (cache_gen[block] != gen[i]) {
+            stale += 1;
+            continue;
+        } else if ((slot = cache_get_slot(block)) != -1) {
+            memcpy(slot_data(slot), buf + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+            cache_touch(slot, 1, priority);
+            *inserted += 1;
+        }
+        missing[i] = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return stale;
+}
+
+/** @brief Size of the buffer cache
+ *
+ *  @return number of slots, 0 if every call goes to the device
+*/
+int cache_size() {
+    return cache_slots != NULL ? cache_nslots : 0;
+}
+
+/** @brief Read blocks through the cache
+ *
+ *  Copies the cached blocks and reads the missing ones from the
+ *  device into the buffer, caching them on the way.
+ *
+ *  @param priority CACHE_NORMAL or CACHE_NOREUSE
+ *  @return nblocks on success and -1 on failure
+*/
+int cache_read(int start_address, int nblocks, void* buffer, int priority) {
+    if (cache_slots == NULL) return cache_dev->read(cache_dev, start_address, nblocks, buffer);
+
+    char* buf = (char*) buffer;
+    char missing[nblocks];
+    unsigned int gen[nblocks];
+    int misses;
+    int inserted;
+
+    memset(missing, 1, nblocks);
+    pthread_mutex_lock(&cache_lock);
+    misses = cache_lookup(start_address, nblocks, missing, gen, buf, priority);
+    cache_stats.hits += nblocks - misses;
+    cache_stats.misses += misses;
+    pthread_mutex_unlock(&cache_lock);
+
+    while (misses > 0) {
+        if ((misses = cache_fill(start_address, nblocks, missing, gen, buf, priority, &inserted)) < 0) return -1;
+        if (misses == 0) break;
+
+        pthread_mutex_lock(&cache_lock);
+        misses = cache_lookup(start_address, nblocks, missing, gen, buf, priority);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return nblocks;
+}
+
+/** @brief Read blocks into the cache ahead of their use
+ *
+ *  Reads the blocks that are not cached yet, with runs of adjacent
+ *  missing blocks merged into one request, and caches them. Nothing
+ *  is evicted that is dirty or being written back, so readahead
+ *  never waits for the flusher and may cache fewer blocks.
+ *
+ *  @param priority CACHE_NORMAL or CACHE_NOREUSE
+ *  @return number of blocks cached or -1 on failure
+*/
+int cache_prefetch(int start_address, int nblocks, int priority) {
+    if (cache_slots == NULL || nblocks <= 0) return 0;
+    if (nblocks > cache_nslots) nblocks = cache_nslots;
+
+    char missing[nblocks];
+    unsigned int gen[nblocks];
+    int misses;
+    int inserted;
+
+    memset(missing, 1, nblocks);
+    pthread_mutex_lock(&cache_lock);
+    misses = cache_lookup(start_address, nblocks, missing, gen, NULL, priority);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (misses == 0) return 0;
+
+    char* buf = (char*) malloc((size_t) nblocks * BLOCK_SIZE);
+    if (buf == NULL) return -1;
+
+    int res = cache_fill(start_address, nblocks, missing, gen, buf, priority, &inserted);
+    free(buf);
+    if (res < 0) return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_stats.readahead += inserted;
+    pthread_mutex_unlock(&cache_lock);
+    return inserted;
+}
+
+/** @brief Evict blocks from the cache
+ *
+ *  Clean blocks are dropped right away. Dirty ones and those being
+ *  written back are made the least recently used, so they go as
+ *  soon as the flusher has written them.
+ *
+ *  @return void
+*/
+void cache_drop(int start_address, int nblocks) {
+    if (cache_slots == NULL) return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int block=start_address; block<start_address + nblocks; block++) {
+        int slot = cache_slot_of[block];
+        if (slot == -1) continue;
+
+        cache_slot_t* s = &cache_slots[slot];
+        if (s->dirty || s->writeback) s->cold = 1;
+        else cache_evict(slot);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** @brief Write blocks into the cache
+ *
+ *  Dirties the cached copies and returns without any disk I/O. The
+ *  writer only waits for the flusher when no slot can be evicted or
+ *  when the dirty ratio is over the hard limit.
+ *
+ *  @param priority CACHE_NORMAL or CACHE_NOREUSE
+ *  @return nblocks
+*/
+int cache_write(int start_address, int nblocks, void* buffer, int priority) {
+    if (cache_slots == NULL) return cache_dev->write(cache_dev, start_address, nblocks, buffer);
+
+    char* buf = (char*) buffer;
+    int waited = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i=0; i<nblocks; i++) {
+        int block = start_address + i;
+        int inserted = 0;
+        int slot;
+
+        while ((slot = cache_slot_of[block]) == -1) {
+            if ((slot = cache_get_slot(block)) != -1) {
+                inserted = 1;
+                break;
+            }
+            waited = 1;
+            cache_flush_wanted = 1;
+            pthread_cond_signal(&cache_flush_cond);
+            pthread_cond_wait(&cache_room_cond, &cache_lock);
+        }
+
+        cache_slot_t* s = &cache_slots[slot];
+        memcpy(slot_data(slot), buf + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+        cache_gen[block] += 1;
+        if (!s->dirty) {
+            s->dirty = 1;
+            s->dirtied = cache_now_ms();
+            cache_dirty_count += 1;
+        }
+        cache_touch(slot, inserted, priority);
+    }
+
+    while (cache_dirty_count > cache_hard_limit) {
+        waited = 1;
+        cache_flush_wanted = 1;
+        pthread_cond_signal(&cache_flush_cond);
+        pthread_cond_wait(&cache_room_cond, &cache_lock);
+    }
+    if (cache_dirty_count > cache_background_limit) pthread_cond_signal(&cache_flush_cond);
+
+    cache_stats.throttled += waited;
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
@@ -0,0 +1,59 @@
+/** @file sfs_cache.h
+ *  @brief Write-back buffer cache between SFS and the disk
+ *
+ *  Every block SFS reads or writes goes through the buffer cache. Reads
+ *  are served from memory when the block is cached, writes only dirty
+ *  the cached copy and return. A background flusher thread writes dirty
+ *  blocks out, sorted by address and merged into multi-block writes,
+ *  once they are older than the expiry time or when too much of the
+ *  cache is dirty. Writers only wait for it above the hard dirty limit.
+ *  Readahead fills the cache ahead of sequential readers, and blocks of
+ *  files advised NOREUSE are the first to be evicted (see sfs_fadvise()).
+ *
+ *  @bug Dirty blocks that have not been flushed are lost on a crash.
+ */
+
+#ifndef SFS_CACHE_H
+#define SFS_CACHE_H
+
+#include "sfs_api.h"
+
+/** @struct buffer cache counters
+ * hits / misses: blocks read from memory / from the disk
+ * flushes: runs of the flusher that wrote anything
+ * blocks_flushed: dirty blocks written out
+ * throttled: times a writer had to wait for the flusher
+ * readahead: blocks read before anyone asked for them
+ * dirty: blocks currently dirty
+*/
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long flushes;
+    unsigned long blocks_flushed;
+    unsigned long throttled;
+    unsigned long readahead;
+    int dirty;
+} sfs_cache_stats_t;
+
+void sfs_set_cache(int nblocks, int expire_ms, int background_pct, int hard_pct);
+void sfs_get_cache_stats(sfs_cache_stats_t* out);
+
+/*
+ *  Insertion priority of the blocks of a request: CACHE_NOREUSE 
+ *  blocks are not expected to be used again and go first
+*/
+#define CACHE_NORMAL 0
+#define CACHE_NOREUSE 1
+
+int cache_start(blockdev_t* dev);
+void cache_stop();
+int cache_size();
+int cache_read(int start_address, int nblocks, void* buffer, int priority);
+int cache_write(int start_address, int nblocks, void* buffer, int priority);
+int cache_prefetch(int start_address, int nblocks, int priority);
+void cache_sync();
+void cache_drop(int start_address, int nblocks);
+void cache_discard(int start_address, int nblocks);
+
+#endif
@@ -0,0 +1,968 @@
+/* sfs_test3.c
+ *
+ * Tests for the extensions to the SFS API: remounting, statfs,
+ * rename, ftruncate, readdir, mmap, fadvise, the buffer cache, the
+ * block devices and the disk emulator's cache tier, arrays and
+ * sparse images.
+ * Every test starts from a fresh file system.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_cache.h"
+
+#define NUM_TEST_FILES 3
+
+/* the i-node table, to see where the allocator put a file's blocks,
+ * and the directory and the device it is on, to leave it on the disk
+ * as a crash would */
+extern inode_t inodes[];
+extern directory_entry_t root[];
+extern blockdev_t *sfs_dev;
+
+static int error_count = 0;
+
+/* Sizes of the test files: within the direct blocks, just past
+ * them, and large enough to need most of the indirect block.
+ */
+static int test_sizes[NUM_TEST_FILES] = {3000, 14000, 200000};
+
+/* expect() - count an error and report it unless ok is true.
+ */
+static void expect(int ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    error_count++;
+  }
+}
+
+/* fill() - the contents byte i of test file n should have.
+ */
+static char fill(int n, int i)
+{
+  return (char) ((i * 7 + n * 13) % 251);
+}
+
+/* write_test_file() - create test file n and fill it, returns its fd.
+ */
+static int write_test_file(int n)
+{
+  char name[MAX_FILENAME];
+  char *buf = malloc(test_sizes[n]);
+  int fd, i;
+
+  for (i = 0; i < test_sizes[n]; i++) {
+    buf[i] = fill(n, i);
+  }
+  sprintf(name, "test3_%d", n);
+  fd = sfs_fopen(name);
+  expect(fd > 0, "creating a test file");
+  expect(sfs_fwrite(fd, buf, test_sizes[n]) == test_sizes[n], "writing a test file");
+  free(buf);
+  return fd;
+}
+
+/* check_test_file() - open test file n and compare it with what
+ * write_test_file() wrote.
+ */
+static void check_test_file(int n)
+{
+  char name[MAX_FILENAME];
+  char *buf = malloc(test_sizes[n]);
+  int fd, i;
+
+  sprintf(name, "test3_%d", n);
+  expect(sfs_getfilesize(name) == test_sizes[n], "size of a test file");
+  fd = sfs_fopen(name);
+  expect(fd > 0, "opening a test file");
+  expect(sfs_pread(fd, buf, test_sizes[n], 0) == test_sizes[n], "reading a test file");
+  for (i = 0; i < test_sizes[n]; i++) {
+    if (buf[i] != fill(n, i)) {
+      fprintf(stderr, "ERROR: data error at offset %d of test file %d\n", i, n);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* test_remount() - everything written before sfs_unmount() must be
+ * there after mksfs(0), and nothing but the disk contents may carry
+ * over from the previous mount.
+ */
+static void test_remount()
+{
+  sfs_statfs_t before, after;
+  sfs_iostats_t io;
+  int i;
+
+  mksfs(1);
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    sfs_fclose(write_test_file(i));
+  }
+  sfs_statfs(&before);
+  sfs_unmount();
+
+  mksfs(0);
+  sfs_get_iostats(&io);
+  expect(io.ops[SFS_OP_OPEN].calls == 0 && io.ops[SFS_OP_WRITE].calls == 0,
+         "I/O counters carried over into the new mount");
+  sfs_statfs(&after);
+  expect(memcmp(&before, &after, sizeof(before)) == 0, "statfs changed across a remount");
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+
+  /* remount a second time after changing the file system again */
+  sfs_remove("test3_0");
+  sfs_unmount();
+  mksfs(0);
+  expect(sfs_getfilesize("test3_0") == -1, "removed file came back after a remount");
+  for (i = 1; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+  sfs_unmount();
+}
+
+/* test_mount_failure() - mounting a disk that cannot be opened must
+ * fail instead of carrying on without a disk.
+ */
+static void test_mount_failure()
+{
+  remove(DISK_NAME);
+  sfs_set_blockdev(&blockdev_pread);
+  expect(mksfs(0) == -1, "mounted a missing pread image");
+  sfs_set_blockdev(&blockdev_mmap);
+  expect(mksfs(0) == -1, "mounted a missing mmap image");
+  sfs_set_blockdev(&blockdev_emu);
+  expect(mksfs(0) == -1, "mounted a missing emulator image");
+}
+
+/* test_blockdevs() - a file system written on each block device must
+ * read back the same after it is unmounted and mounted again.
+ */
+static void test_blockdevs()
+{
+  blockdev_t *devs[] = {&blockdev_pread, &blockdev_mmap, &blockdev_ram};
+  int d, i;
+
+  for (d = 0; d < (int) (sizeof(devs) / sizeof(devs[0])); d++) {
+    sfs_set_blockdev(devs[d]);
+    expect(mksfs(1) == 0, "formatting a block device");
+    for (i = 0; i < NUM_TEST_FILES; i++) {
+      sfs_fclose(write_test_file(i));
+    }
+    sfs_unmount();
+
+    expect(mksfs(0) == 0, "mounting a block device again");
+    for (i = 0; i < NUM_TEST_FILES; i++) {
+      check_test_file(i);
+    }
+    sfs_unmount();
+  }
+  sfs_set_blockdev(&blockdev_emu);
+}
+
+/* test_readv() - readv on each block device must scatter the same
+ * blocks that read returns, and refuse blocks past the end.
+ */
+static void test_readv()
+{
+  blockdev_t *devs[] = {&blockdev_emu, &blockdev_pread, &blockdev_mmap, &blockdev_ram};
+  char written[6 * BLOCK_SIZE], readback[6 * BLOCK_SIZE], scattered[6 * BLOCK_SIZE];
+  struct iovec iov[3];
+  int d, i;
+
+  for (i = 0; i < (int) sizeof(written); i++) {
+    written[i] = fill(1, i);
+  }
+  for (d = 0; d < (int) (sizeof(devs) / sizeof(devs[0])); d++) {
+    blockdev_t *dev = devs[d];
+
+    expect(dev->open(dev, DISK_NAME, BLOCK_SIZE, NUM_TOTAL_BLOCKS, 1) == 0, "opening a block device");
+    dev->write(dev, 10, 6, written);
+    expect(dev->read(dev, 10, 6, readback) == 6, "read on a block device");
+
+    /* one, two and three blocks, scattered in reverse order */
+    memset(scattered, 0, sizeof(scattered));
+    iov[0] = (struct iovec) {scattered + 5 * BLOCK_SIZE, BLOCK_SIZE};
+    iov[1] = (struct iovec) {scattered + 3 * BLOCK_SIZE, 2 * BLOCK_SIZE};
+    iov[2] = (struct iovec) {scattered, 3 * BLOCK_SIZE};
+    expect(dev->readv(dev, 10, iov, 3) == 6, "readv on a block device");
+    expect(memcmp(scattered + 5 * BLOCK_SIZE, readback, BLOCK_SIZE) == 0 &&
+           memcmp(scattered + 3 * BLOCK_SIZE, readback + BLOCK_SIZE, 2 * BLOCK_SIZE) == 0 &&
+           memcmp(scattered, readback + 3 * BLOCK_SIZE, 3 * BLOCK_SIZE) == 0,
+           "readv and read disagree");
+    expect(memcmp(readback, written, sizeof(written)) == 0, "read returned other blocks than were written");
+    expect(dev->readv(dev, NUM_TOTAL_BLOCKS - 2, iov, 3) == -1, "readv past the end of a block device");
+    dev->close(dev);
+  }
+}
+
+/* copy_file() - copy an image file, returns 0 on success.
+ */
+static int copy_file(const char *from, const char *to)
+{
+  char buf[BLOCK_SIZE];
+  FILE *in = fopen(from, "rb");
+  FILE *out = fopen(to, "wb");
+  size_t n;
+  int res = in != NULL && out != NULL ? 0 : -1;
+
+  while (res == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) {
+      res = -1;
+    }
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+  return res;
+}
+
+/* test_disk_cache() - the disk emulator's cache tier must give back
+ * the data after a remount, leave the slow disk complete once it is
+ * closed, and keep dirty blocks across a crash that left them on the
+ * cache image only.
+ */
+static void test_disk_cache()
+{
+  const char *tier = "test3_tier.disk";
+  char buf[8];
+  int fd, i;
+
+  sfs_set_blockdev(&blockdev_emu);
+  set_disk_cache((char *) tier, 32);
+  mksfs(1);
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    sfs_fclose(write_test_file(i));
+  }
+  sfs_remove("test3_0");
+  sfs_unmount();
+
+  /* the cached blocks come back from the slot map on the cache image */
+  mksfs(0);
+  expect(sfs_getfilesize("test3_0") == -1, "removed file came back through the cache tier");
+  for (i = 1; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+  sfs_unmount();
+
+  /* closing the disk destaged everything, the slow disk stands alone */
+  set_disk_cache(NULL, 0);
+  mksfs(0);
+  for (i = 1; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+  sfs_unmount();
+
+  /* crash with dirty slots: keep the images as they were before the
+   * destage that closing the disk does, and mount those */
+  set_disk_cache((char *) tier, 32);
+  mksfs(0);
+  fd = sfs_fopen("test3_1");
+  sfs_pwrite(fd, "dirty", 5, 0);
+  sfs_fclose(fd);
+  sfs_sync();
+  expect(copy_file(tier, "test3_tier.crash") == 0 && copy_file(DISK_NAME, "test3_disk.crash") == 0,
+         "copying the images");
+  sfs_unmount();
+  rename("test3_tier.crash", tier);
+  rename("test3_disk.crash", DISK_NAME);
+
+  mksfs(0);
+  fd = sfs_fopen("test3_1");
+  expect(sfs_pread(fd, buf, 5, 0) == 5 && memcmp(buf, "dirty", 5) == 0, "dirty block lost from the cache image");
+  expect(sfs_pread(fd, buf, 1, 5) == 1 && buf[0] == fill(1, 5), "data next to a dirty block");
+  sfs_fclose(fd);
+  check_test_file(2);
+  sfs_unmount();
+
+  set_disk_cache(NULL, 0);
+  remove(tier);
+}
+
+/* same_file() - whether two image files have the same contents.
+ */
+static int same_file(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  int ca = EOF, cb = EOF;
+
+  if (fa != NULL && fb != NULL) {
+    do {
+      ca = fgetc(fa);
+      cb = fgetc(fb);
+    } while (ca == cb && ca != EOF);
+  }
+  if (fa != NULL) {
+    fclose(fa);
+  }
+  if (fb != NULL) {
+    fclose(fb);
+  }
+  return fa != NULL && fb != NULL && ca == cb;
+}
+
+/* test_disk_array() - a file system on a striped or mirrored disk
+ * must read back the same after a remount, and a mirror must leave
+ * identical images.
+ */
+static void test_disk_array()
+{
+  char *images[] = {"test3_array_0.disk", "test3_array_1.disk", "test3_array_2.disk"};
+  int modes[] = {DISK_STRIPED, DISK_MIRRORED};
+  struct stat st;
+  int m, i;
+
+  expect(set_disk_array(DISK_SINGLE, 1, 3, images) == -1, "accepted a single disk with several images");
+  expect(set_disk_array(42, 1, 3, images) == -1, "accepted an unknown disk array mode");
+
+  sfs_set_blockdev(&blockdev_emu);
+  for (m = 0; m < 2; m++) {
+    expect(set_disk_array(modes[m], 4, 3, images) == 0, "setting up a disk array");
+    expect(mksfs(1) == 0, "formatting a disk array");
+    for (i = 0; i < NUM_TEST_FILES; i++) {
+      sfs_fclose(write_test_file(i));
+    }
+    sfs_unmount();
+
+    expect(mksfs(0) == 0, "mounting a disk array again");
+    for (i = 0; i < NUM_TEST_FILES; i++) {
+      check_test_file(i);
+    }
+    sfs_unmount();
+
+    if (modes[m] == DISK_MIRRORED) {
+      expect(same_file(images[0], images[1]) && same_file(images[0], images[2]), "mirrored images differ");
+    } else {
+      for (i = 0; i < 3; i++) {
+        expect(stat(images[i], &st) == 0 && st.st_size > 0 && st.st_size < (off_t) NUM_TOTAL_BLOCKS * BLOCK_SIZE / 2,
+               "striped image does not hold its share of the disk");
+      }
+    }
+  }
+
+  set_disk_array(DISK_SINGLE, 1, 0, NULL);
+  for (i = 0; i < 3; i++) {
+    remove(images[i]);
+  }
+}
+
+/* test_ram_snapshot() - a RAM disk saved to an image file and loaded
+ * back must mount with the files it had when it was saved.
+ */
+static void test_ram_snapshot()
+{
+  const char *image = "test3_ram.disk";
+  int i;
+
+  sfs_set_blockdev(&blockdev_ram);
+  mksfs(1);
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    sfs_fclose(write_test_file(i));
+  }
+  sfs_unmount();
+  expect(blockdev_ram_save(&blockdev_ram, (char *) image) == 0, "saving a RAM disk");
+
+  /* format the RAM disk again so only the image holds the files */
+  mksfs(1);
+  sfs_unmount();
+  expect(blockdev_ram_load(&blockdev_ram, (char *) image, BLOCK_SIZE) == 0, "loading a RAM disk");
+  expect(mksfs(0) == 0, "mounting a loaded RAM disk");
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+  sfs_unmount();
+
+  remove(image);
+  expect(blockdev_ram_load(&blockdev_ram, (char *) image, BLOCK_SIZE) == -1, "loaded a missing image");
+  sfs_set_blockdev(&blockdev_emu);
+}
+
+/* test_rename() - renaming onto an existing name must replace that
+ * file, keep the renamed file's data and free the replaced file's
+ * blocks and i-node.
+ */
+static void test_rename()
+{
+  sfs_statfs_t expected, after;
+
+  /* the usage of a file system holding only test file 2 */
+  mksfs(1);
+  sfs_fclose(write_test_file(2));
+  sfs_statfs(&expected);
+  sfs_unmount();
+
+  mksfs(1);
+  sfs_fclose(write_test_file(1));
+  sfs_fclose(write_test_file(2));
+  expect(sfs_rename("test3_2", "test3_1") == 0, "renaming over an existing file");
+  expect(sfs_getfilesize("test3_2") == -1, "old name still exists after a rename");
+  expect(sfs_getfilesize("test3_1") == test_sizes[2], "size of the renamed file");
+  sfs_statfs(&after);
+  expect(memcmp(&expected, &after, sizeof(after)) == 0, "replaced file was not released");
+
+  expect(sfs_rename("test3_2", "test3_0") == -1, "renamed a missing file");
+  expect(sfs_rename("test3_1", "") == -1, "renamed a file to an empty name");
+  expect(sfs_rename("test3_1", "test3_1") == 0, "renaming a file onto itself");
+  expect(sfs_getfilesize("test3_1") == test_sizes[2], "renaming onto itself changed the file");
+
+  /* the renamed file keeps its data under the new name across a remount */
+  sfs_unmount();
+  mksfs(0);
+  expect(sfs_rename("test3_1", "test3_2") == 0, "renaming back");
+  check_test_file(2);
+  sfs_unmount();
+}
+
+/* rename_setup() - make a file system where test files 1 and 2 have
+ * their directory entries in different blocks, returns their slots.
+ */
+static void rename_setup(int *src, int *dst)
+{
+  char name[MAX_FILENAME];
+  int fd, i;
+
+  mksfs(1);
+  sfs_fclose(write_test_file(1));
+  for (i = 0; i < BLOCK_SIZE / (int) sizeof(directory_entry_t); i++) {
+    sprintf(name, "filler_%d", i);
+    fd = sfs_fopen(name);
+    sfs_fclose(fd);
+  }
+  sfs_fclose(write_test_file(2));
+  *src = sfs_lookup("test3_1") - 1;
+  *dst = sfs_lookup("test3_2") - 1;
+}
+
+/* test_rename_crash() - a rename of test file 1 over test file 2 cut
+ * short at each of its directory writes must come back after the
+ * next mount with either the old or the new name, and without
+ * leaking the blocks of the replaced file.
+ */
+static void test_rename_crash()
+{
+  sfs_statfs_t before, renamed, st;
+  int src, dst, step;
+
+  rename_setup(&src, &dst);
+  expect(src / (BLOCK_SIZE / (int) sizeof(directory_entry_t)) != dst / (BLOCK_SIZE / (int) sizeof(directory_entry_t)),
+         "entries of the renamed and the replaced file share a block");
+  sfs_statfs(&before);
+  expect(sfs_rename("test3_1", "test3_2") == 0, "renaming across directory blocks");
+  sfs_statfs(&renamed);
+  expect(sfs_getfilesize("test3_1") == -1 && sfs_getfilesize("test3_2") == test_sizes[1],
+         "rename across directory blocks");
+  sfs_unmount();
+
+  /* 0: the replaced entry is marked, 1: the new name is written too,
+   * 2: the replaced entry is cleared but its i-node not released */
+  for (step = 0; step < 3; step++) {
+    rename_setup(&src, &dst);
+    sfs_sync();
+
+    root[dst].mode = step < 2 ? DIR_REPLACED : DIR_FREE;
+    if (step == 2) {
+      memset(root[dst].names, 0, MAX_FILENAME);
+    }
+    if (step > 0) {
+      strcpy(root[src].names, "test3_2");
+    }
+    sfs_dev->write(sfs_dev, 1 + NUM_INODE_BLOCKS, NUM_DATA_BLOCKS_FOR_DIR, root);
+
+    /* no sfs_unmount(), the next mount has to repair the directory */
+    mksfs(0);
+    sfs_statfs(&st);
+    if (step == 0) {
+      expect(memcmp(&before, &st, sizeof(st)) == 0, "statfs after a crash before the rename");
+      check_test_file(1);
+      check_test_file(2);
+    } else {
+      expect(memcmp(&renamed, &st, sizeof(st)) == 0, "statfs after a crash during the rename");
+      expect(sfs_getfilesize("test3_1") == -1, "old name back after a crash during the rename");
+      expect(sfs_getfilesize("test3_2") == test_sizes[1], "new name lost after a crash during the rename");
+    }
+    sfs_unmount();
+  }
+}
+
+/* blocks_for() - data blocks a file of the given size takes, counting
+ * its indirect block.
+ */
+static int blocks_for(int size)
+{
+  int blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  return blocks > NUM_DIRECT_POINTERS ? blocks + 1 : blocks;
+}
+
+/* allocated() - bytes the host file system allocated for a file.
+ */
+static long allocated(const char *name)
+{
+  struct stat st;
+
+  return stat(name, &st) == 0 ? (long) st.st_blocks * 512 : -1;
+}
+
+/* can_punch_holes() - whether the host file system in the current
+ * directory frees the blocks of a punched hole.
+ */
+static int can_punch_holes()
+{
+  const char *name = "test3_punch.tmp";
+  char buf[64 * 1024];
+  long before;
+  int fd, ok = 0;
+
+  memset(buf, 1, sizeof(buf));
+  fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1 && write(fd, buf, sizeof(buf)) == (ssize_t) sizeof(buf) && fsync(fd) == 0) {
+    before = allocated(name);
+    ok = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, sizeof(buf)) == 0 &&
+         allocated(name) < before;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  remove(name);
+  return ok;
+}
+
+/* test_sparse_image() - a fresh disk image must be sparse, and removing
+ * a large file must hand its blocks back to the host file system.
+ */
+static void test_sparse_image()
+{
+  long fresh, written, removed;
+  int data = blocks_for(test_sizes[2]) * BLOCK_SIZE;
+
+  if (!can_punch_holes()) {
+    fprintf(stderr, "Skipping the sparse image test: no hole punching here\n");
+    return;
+  }
+
+  sfs_set_blockdev(&blockdev_emu);
+  mksfs(1);
+  sfs_sync();
+  fresh = allocated(DISK_NAME);
+  expect(fresh >= 0 && fresh < (long) NUM_TOTAL_BLOCKS * BLOCK_SIZE / 2, "fresh disk image is not sparse");
+
+  sfs_fclose(write_test_file(2));
+  sfs_sync();
+  written = allocated(DISK_NAME);
+  expect(written >= fresh + data / 2, "writing a file did not allocate its blocks");
+
+  sfs_remove("test3_2");
+  sfs_sync();
+  removed = allocated(DISK_NAME);
+  expect(removed <= written - data / 2, "removing a file did not punch holes for its blocks");
+  sfs_unmount();
+}
+
+/* test_statfs() - the free counters must follow every allocation and
+ * release, and be rebuilt when the file system was not unmounted.
+ */
+static void test_statfs()
+{
+  sfs_statfs_t fresh, st;
+  int i, used = 0;
+
+  mksfs(1);
+  sfs_statfs(&fresh);
+  expect(fresh.block_size == BLOCK_SIZE, "statfs block size");
+  expect(fresh.free_blocks == fresh.total_blocks, "fresh file system has used blocks");
+  expect(fresh.free_inodes == fresh.total_inodes, "fresh file system has used i-nodes");
+
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    sfs_fclose(write_test_file(i));
+    used += blocks_for(test_sizes[i]);
+    sfs_statfs(&st);
+    expect(st.free_blocks == fresh.free_blocks - used, "free blocks after a write");
+    expect(st.free_inodes == fresh.free_inodes - i - 1, "free i-nodes after a create");
+  }
+
+  /* leave without sfs_unmount(), the next mount has to recount */
+  sfs_remove("test3_1");
+  used -= blocks_for(test_sizes[1]);
+  mksfs(0);
+  sfs_statfs(&st);
+  expect(st.free_blocks == fresh.free_blocks - used, "free blocks after an unclean remount");
+  expect(st.free_inodes == fresh.free_inodes - 2, "free i-nodes after an unclean remount");
+
+  sfs_remove("test3_0");
+  sfs_remove("test3_2");
+  sfs_statfs(&st);
+  expect(memcmp(&fresh, &st, sizeof(st)) == 0, "removing every file did not free everything");
+  sfs_unmount();
+}
+
+/* test_ftruncate() - shrinking a file must keep what is left of it,
+ * free the blocks past the new end and keep the descriptor usable.
+ */
+static void test_ftruncate()
+{
+  sfs_statfs_t fresh, st;
+  char buf[64];
+  int fd, i, length;
+
+  mksfs(1);
+  sfs_statfs(&fresh);
+  fd = write_test_file(2);
+
+  /* cut into the direct blocks, which also drops the indirect block */
+  length = 5 * BLOCK_SIZE + 17;
+  expect(sfs_ftruncate(fd, length) == 0, "shrinking a file");
+  expect(sfs_getfilesize("test3_2") == length, "size after sfs_ftruncate");
+  sfs_statfs(&st);
+  expect(st.free_blocks == fresh.free_blocks - blocks_for(length), "blocks past the new end were kept");
+  expect(sfs_ftruncate(fd, length + 1) == -1, "grew a file with sfs_ftruncate");
+
+  /* the read-write pointer was past the new end and is pulled back */
+  expect(sfs_fwrite(fd, "tail", 4) == 4, "appending after sfs_ftruncate");
+  expect(sfs_pread(fd, buf, 4, length) == 4 && memcmp(buf, "tail", 4) == 0,
+         "append did not land at the new end");
+  for (i = 0; i < length; i += 97) {
+    if (sfs_pread(fd, buf, 1, i) != 1 || buf[0] != fill(2, i)) {
+      fprintf(stderr, "ERROR: data error at offset %d after sfs_ftruncate\n", i);
+      error_count++;
+      break;
+    }
+  }
+
+  expect(sfs_ftruncate(fd, 0) == 0, "truncating a file to zero");
+  sfs_statfs(&st);
+  expect(st.free_blocks == fresh.free_blocks, "empty file still holds blocks");
+  expect(sfs_fread(fd, buf, 1) == 0, "read past the end of an empty file");
+  sfs_fclose(fd);
+  expect(sfs_ftruncate(fd, 0) == -1, "truncated through a closed descriptor");
+  sfs_unmount();
+}
+
+#define NUM_DIR_FILES 10
+
+/* list_files() - lists the directory in batches of batch entries from
+ * the cursor pos, counting in seen how often each dir_%d file shows up.
+ * Stops once the directory has been listed or after max_calls calls.
+ */
+static void list_files(int *pos, int batch, int max_calls, int *seen)
+{
+  sfs_dirent_t entries[NUM_DIR_FILES];
+  int i, n, k;
+
+  for (k = 0; k < max_calls && (n = sfs_readdir(pos, entries, batch)) > 0; k++) {
+    for (i = 0; i < n; i++) {
+      int j = atoi(entries[i].name + 4);
+      expect(strncmp(entries[i].name, "dir_", 4) == 0 && j >= 0 && j < 2 * NUM_DIR_FILES,
+             "unexpected name listed by sfs_readdir");
+      expect(entries[i].inode == sfs_lookup(entries[i].name), "i-node listed by sfs_readdir");
+      expect(entries[i].size == (unsigned int) j, "size listed by sfs_readdir");
+      seen[j]++;
+    }
+  }
+}
+
+/* test_readdir() - sfs_readdir() cursors must list every file once,
+ * independently of each other and of files created or removed
+ * between two calls.
+ */
+static void test_readdir()
+{
+  char name[MAX_FILENAME];
+  int seen[2 * NUM_DIR_FILES] = {0};
+  int other[2 * NUM_DIR_FILES] = {0};
+  int pos = 0, pos2 = 0;
+  int fd, i;
+
+  mksfs(1);
+  for (i = 0; i < NUM_DIR_FILES; i++) {
+    sprintf(name, "dir_%d", i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, "0123456789", i);
+    sfs_fclose(fd);
+  }
+
+  /* two listings at once, in batches of different sizes */
+  list_files(&pos, 3, 1, seen);
+  list_files(&pos2, 4, NUM_DIR_FILES, other);
+  list_files(&pos, 3, NUM_DIR_FILES, seen);
+  for (i = 0; i < NUM_DIR_FILES; i++) {
+    expect(seen[i] == 1 && other[i] == 1, "file not listed exactly once");
+  }
+
+  /* change the directory half way through a listing */
+  memset(seen, 0, sizeof(seen));
+  pos = 0;
+  list_files(&pos, 5, 1, seen);
+  sfs_remove("dir_9");
+  sprintf(name, "dir_%d", NUM_DIR_FILES + 9);
+  fd = sfs_fopen(name);
+  sfs_fwrite(fd, "0123456789abcdefghij", NUM_DIR_FILES + 9);
+  sfs_fclose(fd);
+  list_files(&pos, 5, NUM_DIR_FILES, seen);
+  for (i = 0; i < 9; i++) {
+    expect(seen[i] == 1, "file not listed exactly once while the directory changed");
+  }
+  expect(seen[NUM_DIR_FILES + 9] <= 1, "new file listed twice");
+  expect(sfs_readdir(&pos, NULL, 1) == 0, "listing did not end");
+  sfs_unmount();
+}
+
+/* data_writes() - data blocks written by sfs_fwrite/sfs_pwrite so far.
+ */
+static unsigned long data_writes()
+{
+  sfs_iostats_t io;
+
+  sfs_get_iostats(&io);
+  return io.ops[SFS_OP_WRITE].blocks_written[BLOCK_DATA];
+}
+
+/* test_mmap() - a mapping must show the file as of sfs_mmap(), and
+ * sfs_msync() must write back exactly the blocks changed through it.
+ */
+static void test_mmap()
+{
+  char *ro, *rw;
+  char buf[8];
+  unsigned long writes;
+  int fd, i, offset, length;
+
+  mksfs(1);
+  fd = write_test_file(2);
+
+  offset = 1000;
+  length = 20 * BLOCK_SIZE;
+  ro = sfs_mmap(fd, offset, length, 0);
+  expect(ro != NULL, "mapping a file read-only");
+  for (i = 0; ro != NULL && i < length; i++) {
+    if (ro[i] != fill(2, offset + i)) {
+      fprintf(stderr, "ERROR: data error at offset %d of a mapping\n", i);
+      error_count++;
+      break;
+    }
+  }
+
+  /* change the second and the last block of the mapping, and write to
+   * a block in between through the descriptor */
+  rw = sfs_mmap(fd, offset, length, 1);
+  expect(rw != NULL, "mapping a file writable");
+  if (rw != NULL) {
+    rw[BLOCK_SIZE] = 'x';
+    rw[length - 1] = 'y';
+    sfs_pwrite(fd, "zz", 2, offset + 5 * BLOCK_SIZE);
+
+    writes = data_writes();
+    expect(sfs_msync(rw) == 0, "sfs_msync");
+    expect(data_writes() - writes == 2, "sfs_msync wrote back unchanged blocks");
+    expect(sfs_pread(fd, buf, 1, offset + BLOCK_SIZE) == 1 && buf[0] == 'x', "change made through a mapping");
+    expect(sfs_pread(fd, buf, 2, offset + 5 * BLOCK_SIZE) == 2 && memcmp(buf, "zz", 2) == 0,
+           "sfs_msync overwrote a write made through the descriptor");
+
+    writes = data_writes();
+    expect(sfs_msync(rw) == 0 && data_writes() == writes, "sfs_msync of an unchanged mapping wrote");
+    rw[0] = 'w';
+    expect(sfs_munmap(rw) == 0, "sfs_munmap of a writable mapping");
+    expect(sfs_pread(fd, buf, 1, offset) == 1 && buf[0] == 'w', "sfs_munmap did not write back");
+  }
+
+  expect(ro == NULL || ro[BLOCK_SIZE] == fill(2, offset + BLOCK_SIZE), "read-only mapping followed the file");
+  expect(sfs_munmap(ro) == 0, "sfs_munmap of a read-only mapping");
+  expect(sfs_munmap(ro) == -1, "unmapped a mapping twice");
+  expect(sfs_mmap(fd, test_sizes[2] - 10, 20, 0) == NULL, "mapped past the end of a file");
+  sfs_fclose(fd);
+  sfs_unmount();
+}
+
+/* test_buddy() - a file written in one call must get contiguous
+ * blocks, and freed blocks must merge again so that the same file
+ * lands where it would on a fresh file system.
+ */
+static void test_buddy()
+{
+  char name[MAX_FILENAME];
+  unsigned int fresh_direct[NUM_DIRECT_POINTERS];
+  int fd, ino, i, n;
+
+  mksfs(1);
+  sfs_fclose(write_test_file(2));
+  ino = sfs_lookup("test3_2");
+  memcpy(fresh_direct, inodes[ino].direct, sizeof(fresh_direct));
+  for (i = 1; i < NUM_DIRECT_POINTERS; i++) {
+    expect(fresh_direct[i] == fresh_direct[i - 1] + 1, "blocks of one write are not contiguous");
+  }
+  sfs_unmount();
+
+  /* fragment the free space with one-block files, then free them in
+   * an order that leaves holes until the very end */
+  mksfs(1);
+  for (n = 0; n < NUM_FILE_INODES - 1; n++) {
+    sprintf(name, "frag_%d", n);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, "x", 1);
+    sfs_fclose(fd);
+  }
+  for (i = 0; i < 2; i++) {
+    int j;
+    for (j = i; j < n; j += 2) {
+      sprintf(name, "frag_%d", j);
+      sfs_remove(name);
+    }
+  }
+
+  sfs_fclose(write_test_file(2));
+  ino = sfs_lookup("test3_2");
+  expect(memcmp(fresh_direct, inodes[ino].direct, sizeof(fresh_direct)) == 0,
+         "freed blocks did not merge back");
+  check_test_file(2);
+  sfs_unmount();
+}
+
+/* test_cache() - with a buffer cache much smaller than the files,
+ * data must survive eviction, repeated reads must hit, and
+ * sfs_sync() must leave nothing dirty.
+ */
+static void test_cache()
+{
+  sfs_cache_stats_t before, after;
+  char buf[8];
+  int fd, i, nslots;
+
+  /* keep whatever cache size the program was started with */
+  mksfs(1);
+  nslots = cache_size();
+  sfs_unmount();
+
+  sfs_set_cache(16, 0, 0, 0);
+  mksfs(1);
+  expect(cache_size() == 16, "size of the buffer cache");
+  for (i = 0; i < NUM_TEST_FILES; i++) {
+    sfs_fclose(write_test_file(i));
+  }
+  fd = sfs_fopen("test3_0");
+  sfs_pwrite(fd, "ab", 2, 100);
+  for (i = 1; i < NUM_TEST_FILES; i++) {
+    check_test_file(i);
+  }
+  expect(sfs_pread(fd, buf, 2, 100) == 2 && memcmp(buf, "ab", 2) == 0, "write lost by an evicted block");
+
+  sfs_get_cache_stats(&before);
+  sfs_pread(fd, buf, 2, 100);
+  sfs_get_cache_stats(&after);
+  expect(after.hits > before.hits && after.misses == before.misses, "reading a cached block went to the disk");
+  expect(after.misses > 0, "a cache smaller than the files never missed");
+
+  expect(sfs_sync() == 0, "sfs_sync");
+  sfs_get_cache_stats(&after);
+  expect(after.dirty == 0, "dirty blocks left after sfs_sync");
+  expect(after.blocks_flushed > 0, "the cache never wrote back");
+  sfs_fclose(fd);
+  sfs_unmount();
+
+  sfs_set_cache(nslots, 0, 0, 0);
+}
+
+/* read_sequentially() - read n blocks of fd from block first on with one
+ * sfs_fread() per block, the way a sequential reader would.
+ */
+static void read_sequentially(int fd, int first, int n)
+{
+  char buf[BLOCK_SIZE];
+  int i;
+
+  sfs_fseek(fd, first * BLOCK_SIZE);
+  for (i = 0; i < n; i++) {
+    sfs_fread(fd, buf, BLOCK_SIZE);
+  }
+}
+
+/* test_fadvise() - RANDOM must turn readahead off, WILLNEED must
+ * bring a range into the buffer cache and DONTNEED must drop it.
+ */
+static void test_fadvise()
+{
+  sfs_cache_stats_t before, after;
+  char buf[20 * BLOCK_SIZE];
+  int fd, nslots;
+
+  mksfs(1);
+  nslots = cache_size();
+  sfs_unmount();
+
+  sfs_set_cache(256, 0, 0, 0);
+  mksfs(1);
+  fd = write_test_file(2);
+  sfs_sync();
+
+  /* a sequential reader gets readahead by default, but not when the
+   * file was advised RANDOM */
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_DONTNEED) == 0, "SFS_FADV_DONTNEED");
+  sfs_get_cache_stats(&before);
+  read_sequentially(fd, 0, 40);
+  sfs_get_cache_stats(&after);
+  expect(after.readahead > before.readahead, "no readahead for a sequential reader");
+
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_DONTNEED) == 0, "SFS_FADV_DONTNEED");
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_RANDOM) == 0, "SFS_FADV_RANDOM");
+  sfs_get_cache_stats(&before);
+  read_sequentially(fd, 0, 40);
+  sfs_get_cache_stats(&after);
+  expect(after.readahead == before.readahead, "readahead for a file advised RANDOM");
+  expect(after.misses >= before.misses + 40, "blocks stayed cached after SFS_FADV_DONTNEED");
+
+  /* everything advised WILLNEED is read from memory afterwards; the
+   * file is still advised RANDOM so sfs_fread() reads nothing ahead */
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_DONTNEED) == 0, "SFS_FADV_DONTNEED");
+  expect(sfs_fadvise(fd, 0, sizeof(buf), SFS_FADV_WILLNEED) == 0, "SFS_FADV_WILLNEED");
+  sfs_get_cache_stats(&before);
+  expect(sfs_pread(fd, buf, sizeof(buf), 0) == sizeof(buf), "reading a range advised WILLNEED");
+  sfs_get_cache_stats(&after);
+  expect(after.misses == before.misses, "a range advised WILLNEED was read from the disk");
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_NORMAL) == 0, "SFS_FADV_NORMAL");
+
+  expect(sfs_fadvise(fd, 0, 0, 42) == -1, "accepted unknown advice");
+  expect(sfs_fadvise(fd, -1, 0, SFS_FADV_WILLNEED) == -1, "accepted a negative offset");
+  sfs_fclose(fd);
+  expect(sfs_fadvise(fd, 0, 0, SFS_FADV_NORMAL) == -1, "advice on a closed file");
+  check_test_file(2);
+  sfs_unmount();
+
+  sfs_set_cache(nslots, 0, 0, 0);
+}
+
+int main(int argc, char **argv)
+{
+  test_remount();
+  test_rename();
+  test_rename_crash();
+  test_statfs();
+  test_ftruncate();
+  test_readdir();
+  test_mmap();
+  test_buddy();
+  test_cache();
+  test_fadvise();
+  test_blockdevs();
+  test_readv();
+  test_disk_cache();
+  test_disk_array();
+  test_sparse_image();
+  test_ram_snapshot();
+  test_mount_failure();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
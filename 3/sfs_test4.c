@@ -0,0 +1,136 @@
+/* sfs_test4.c
+ *
+ * Tests the asynchronous file system calls of sfs_async.h. Several
+ * SUT tasks each create their own file, write it in pieces, seek back,
+ * read it back and compare, all through the I/O executor, while a
+ * compute task keeps ticking. Build with ../2/sut.c and -I../2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_async.h"
+
+#define NUM_TASKS 8
+#define NUM_PIECES 6
+#define PIECE_SIZE 700
+#define FILE_SIZE (NUM_PIECES * PIECE_SIZE)
+
+static int error_count = 0;
+
+/* counters of the compute task, and how many file tasks are left */
+static int ticks = 0;
+static int running = NUM_TASKS;
+static int overlapped = 0;
+static int next_task = 0;
+
+/* expect() - count an error and report it unless ok is true.
+ */
+static void expect(int ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    error_count++;
+  }
+}
+
+/* fill() - the contents byte i of the file of task n should have.
+ */
+static char fill(int n, int i)
+{
+  return (char) ((i * 11 + n * 17) % 251);
+}
+
+/* run_getfilesize() - sut_io() runner for sfs_getfilesize().
+ */
+static void *run_getfilesize(void *arg)
+{
+  return (void *) (long) sfs_getfilesize((char *) arg);
+}
+
+/* file_task() - write a file in pieces, read it back and check it.
+ */
+static void file_task()
+{
+  char name[MAX_FILENAME];
+  char buf[FILE_SIZE];
+  char back[FILE_SIZE];
+  int n = next_task++;
+  int fd, i, before;
+
+  for (i = 0; i < FILE_SIZE; i++) {
+    buf[i] = fill(n, i);
+  }
+  sprintf(name, "async_%d", n);
+  fd = sfs_aopen(name);
+  expect(fd > 0, "sfs_aopen");
+
+  for (i = 0; i < NUM_PIECES; i++) {
+    before = ticks;
+    expect(sfs_awrite(fd, buf + i * PIECE_SIZE, PIECE_SIZE) == PIECE_SIZE, "sfs_awrite");
+    if (ticks != before) {
+      overlapped = 1;
+    }
+    sut_yield();
+  }
+
+  expect(sfs_fseek(fd, 0) == 0, "seeking back to the start");
+  memset(back, 0, sizeof(back));
+  expect(sfs_aread(fd, back, FILE_SIZE) == FILE_SIZE, "sfs_aread");
+  expect(memcmp(buf, back, FILE_SIZE) == 0, "data read back differs from what was written");
+  expect(sfs_aclose(fd) == 0, "sfs_aclose");
+  expect((long) sut_io(run_getfilesize, name) == FILE_SIZE, "size of a file through sut_io");
+
+  running--;
+  sut_exit();
+}
+
+/* tick_task() - compute task that runs while the file tasks wait.
+ */
+static void tick_task()
+{
+  while (running > 0) {
+    ticks++;
+    sut_yield();
+  }
+  sut_exit();
+}
+
+int main(int argc, char **argv)
+{
+  char name[MAX_FILENAME];
+  char buf[FILE_SIZE];
+  int fd, i, n;
+
+  /* make every call wait for the disk so that the tasks overlap */
+  set_disk_latency(200, 0);
+  mksfs(1);
+  sut_init();
+  for (n = 0; n < NUM_TASKS; n++) {
+    expect(sut_create(file_task), "sut_create");
+  }
+  expect(sut_create(tick_task), "sut_create");
+  sut_shutdown();
+
+  expect(running == 0, "a file task did not finish");
+  expect(overlapped, "no compute task ran while a file task waited for the disk");
+
+  /* everything the tasks wrote is there for synchronous callers too */
+  for (n = 0; n < NUM_TASKS; n++) {
+    sprintf(name, "async_%d", n);
+    fd = sfs_fopen(name);
+    expect(sfs_pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE, "reading a file written by a task");
+    for (i = 0; i < FILE_SIZE; i++) {
+      if (buf[i] != fill(n, i)) {
+        fprintf(stderr, "ERROR: data error at offset %d of the file of task %d\n", i, n);
+        error_count++;
+        break;
+      }
+    }
+    sfs_fclose(fd);
+  }
+  sfs_unmount();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}